@@ -1,26 +1,14 @@
 #include <string>
-#include <cstring>
+#include <vector>
 #include <cstdlib>
+#include <fstream>
 #include <iostream>
 
-extern "C" {
-	#include <netdb.h>
-	#include <unistd.h>
-	#include <sys/wait.h>
-	#include <sys/types.h>
-	#include <arpa/inet.h>
-	#include <sys/socket.h>
-	#include <netinet/in.h>
-}
-
-#include "reader.h"
 #include "cla_parser.h"
-#include "syscall_utils.h"
+#include "transfer_client.h"
 
-void copy_directory(Reader& reader, std::string& target_directory);
-
-static bool get_args(int argc, char *argv[],
-	                 std::string* server_ip, int* port, std::string* directory) {
+static bool get_args(int argc, char *argv[], std::string* server_ip, int* port,
+	                 std::vector<std::string>* directories, bool* dedup) {
 	ClaParser cla_parser(argc, argv);
 
 	if (!cla_parser.valid_args()) {
@@ -29,83 +17,88 @@ static bool get_args(int argc, char *argv[],
 
 	*server_ip = cla_parser.get_argument(std::string("-i"));
 	std::string port_ = cla_parser.get_argument(std::string("-p"));
-	*directory = cla_parser.get_argument(std::string("-d"));
+	std::string directory = cla_parser.get_argument(std::string("-d"));
+	std::string list_file = cla_parser.get_argument(std::string("-l"));
+	std::string dedup_ = cla_parser.get_argument(std::string("-D"));
 
-	if (port_.empty() || server_ip->empty() || directory->empty()) {
+	// Either a single directory (-d), or a file listing many of them, one per line (-l)
+	if (port_.empty() || server_ip->empty() || directory.empty() == list_file.empty()) {
 		return false;
 	}
 
 	*port = atoi(port_.c_str());
+	*dedup = !dedup_.empty() && atoi(dedup_.c_str()) != 0;
+
+	if (list_file.empty()) {
+		directories->push_back(directory);
+		return true;
+	}
+
+	std::ifstream file(list_file.c_str());
+	for (std::string line; std::getline(file, line); ) {
+		if (!line.empty()) {
+			directories->push_back(line);
+		}
+	}
 
-	return true;
+	return file.eof() && !directories->empty();
 }
 
 int main(int argc, char* argv[]) {
-	std::string server_ip;
-	int port;
-	std::string directory;
+	TransferRequest request;
 
 	// Process command line arguments
-	if (!get_args(argc, argv, &server_ip, &port, &directory)) {
+	if (!get_args(argc, argv, &request.host, &request.port, &request.directories,
+	              &request.dedup)) {
 		std::cerr << "Invalid program arguments\n";
 		exit(EXIT_FAILURE);
 	}
 
 	std::cerr << "\n"
 			  << "Client's parameters are:\n\n"
-	          << "serverIP: " << server_ip << "\n"
-	          << "port: " << port << "\n"
-	          << "directory: " << directory << "\n\n";
+	          << "serverIP: " << request.host << "\n"
+	          << "port: " << request.port << "\n"
+	          << "directories: " << request.directories[0]
+	          << (request.directories.size() > 1 ? ", ..." : "") << "\n"
+	          << "dedup: " << (request.dedup ? "on" : "off") << "\n\n";
 
-	// Configure sockets to request data from the server
-	int sock;
-	call_or_exit(sock = socket(AF_INET, SOCK_STREAM, 0), "socket (client)");
+	// Read and replicate locally the requested directories from the server (more than
+	// one of them are requested in a session, over the same connection)
+	TransferCallbacks callbacks;
+	bool ok = false;
 
-	struct hostent* hostent;
-	struct sockaddr_in server;
+	callbacks.on_directory = [](int id, const std::string& directory, int nfiles) {
+		std::cerr << "About to read " << nfiles << " files from the server\n\n";
+	};
 
-	if ((hostent = gethostbyname(server_ip.c_str())) == nullptr) {
-		herror("gethostbyname");
-		exit(EXIT_FAILURE);
-	}
+	callbacks.on_file = [](int id, const std::string& path) {
+		std::cerr << "Received: " << path << "\n";
+	};
 
-	server.sin_family = AF_INET;
-	memcpy(&server.sin_addr, hostent->h_addr, hostent->h_length);
-	server.sin_port = htons(port);
+	callbacks.on_skipped = [](int id, const std::string& path) {
+		std::cerr << "Skipped: " << path << " (the server couldn't read it)\n";
+	};
 
-	std::cerr << "Connecting to " << server_ip << " on port " << port << "...\n";
+	callbacks.on_complete = [&ok](int id, bool success, const std::string& error) {
+		if (!success) {
+			std::cerr << "Transfer failed: " << error << "\n";
+		}
 
-	call_or_exit(
-		connect(sock, (struct sockaddr *) &server, sizeof(server)),
-		"connect (client)"
-	);
+		ok = success;
+	};
 
-	std::cerr << "Connected succesfully\n\n";
+	std::cerr << "Connecting to " << request.host << " on port " << request.port << "...\n";
 
-	int dirname_size;
-	std::string msg;
+	TransferClient client;
+	client.start(request, callbacks);
+	client.run();
 
-	// Transmit request (size + payload) for 'directory' over to the server
-	dirname_size = directory.size();
-	for (int i = 0; i < 4; i++) {
-		msg += (char) (dirname_size >> (i * 8)) & 0xFF;
+	if (!ok) {
+		exit(EXIT_FAILURE);
 	}
 
-	msg += directory;
-	call_or_exit(write_(sock, msg.c_str(), msg.size()), "write_ (client)");
-
-	// Read and replicate locally the requested directory from the server
-	Reader reader(sock);
-	copy_directory(reader, directory);
-
-	// Let the server know that the transaction has been completed
-	msg = " ";
-	call_or_exit(write_(sock, msg.c_str(), msg.size()), "write_ (client)");
-
 	std::cerr << "\n"
 	          << "Transfer has been completed. Closing the connection...\n\n";
 
-	call_or_exit(close(sock), "close socket (client)");
-
 	return 0;
 }
@@ -0,0 +1,24 @@
+#!/bin/bash
+
+# Execute as: ./run_benchmark.sh <server's ip address> <server's port> <directory> [<runs>]
+# Transfers <directory> <runs> times (default: 5) and reports the average throughput.
+# To emulate a WAN link on loopback, add delay before running it (requires root):
+#   tc qdisc add dev lo root netem delay 20ms    (remove with: tc qdisc del dev lo root)
+
+runs=${4:-5}
+client=$(pwd)/remoteClient
+workdir=$(mktemp -d)
+total_bytes=0
+start=$(date +%s%N)
+
+for ((i = 0; i < runs; i++)); do
+	(cd "$workdir" && "$client" -i $1 -p $2 -d $3 2> /dev/null) || exit 1
+	total_bytes=$((total_bytes + $(find "$workdir" -type f -printf "%s\n" | awk '{ s += $1 } END { print s + 0 }')))
+	rm -rf "${workdir:?}"/*
+done
+
+end=$(date +%s%N)
+rm -rf "$workdir"
+
+awk -v b=$total_bytes -v ns=$((end - start)) -v d="$3" -v r=$runs \
+	'BEGIN { printf "%s: %d runs, %.1f MiB/s\n", d, r, b / (ns / 1e9) / 1048576 }'
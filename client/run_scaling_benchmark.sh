@@ -0,0 +1,44 @@
+#!/bin/bash
+
+# Execute as: ./run_scaling_benchmark.sh <port> <directory> [<max_cores>]
+# Starts a local server on 1, 2, 4, ... up to <max_cores> cores (default: all of them,
+# capped at 64), with one pinned worker group per core, and reports the throughput of
+# 4 concurrent clients per core transferring <directory>, in total and per core.
+
+max_cores=${3:-$(nproc)}
+if ((max_cores > 64)); then
+	max_cores=64
+fi
+
+client=$(pwd)/remoteClient
+
+for ((cores = 1; cores <= max_cores; cores *= 2)); do
+	(cd ../server && exec taskset -c 0-$((cores - 1)) ./dataServer -p $1 -s $((2 * cores)) -q 64 \
+		-b 4096 -g $cores -c core 2> /dev/null) &
+	server=$!
+	sleep 0.5
+
+	workdir=$(mktemp -d)
+	clients=()
+	start=$(date +%s%N)
+
+	for ((i = 0; i < 4 * cores; i++)); do
+		mkdir "$workdir/$i"
+		(cd "$workdir/$i" && "$client" -i 127.0.0.1 -p $1 -d $2 2> /dev/null) &
+		clients+=($!)
+	done
+
+	wait "${clients[@]}"
+	end=$(date +%s%N)
+
+	bytes=$(find "$workdir" -type f -printf "%s\n" | awk '{ s += $1 } END { print s + 0 }')
+	rm -rf "$workdir"
+
+	kill $server
+	wait $server 2> /dev/null
+
+	awk -v b=$bytes -v ns=$((end - start)) -v c=$cores 'BEGIN {
+		rate = b / (ns / 1e9) / 1048576
+		printf "%2d cores: %8.1f MiB/s, %8.1f MiB/s per core\n", c, rate, rate / c
+	}'
+done
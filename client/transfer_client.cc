@@ -0,0 +1,736 @@
+#include "transfer_client.h"
+
+#include <string>
+#include <vector>
+#include <cerrno>
+#include <cstring>
+#include <climits>
+
+extern "C" {
+	#include <poll.h>
+	#include <netdb.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <sys/stat.h>
+	#include <sys/ioctl.h>
+	#include <sys/types.h>
+	#include <sys/socket.h>
+	#include <netinet/in.h>
+	#include <linux/fs.h>
+}
+
+#include "protocol.h"
+
+// Size of the buffer that each transfer receives data in
+#define RECV_BUFSIZE (64 << 10)
+
+// States of a transfer. Most of them correspond to the field of the server's response
+// that is expected next (see the Protocol section of README.md).
+enum State {
+	CONNECTING,
+	READ_NFILES,
+	READ_NAME_SIZE,
+	READ_NAME,
+	READ_FILE_SIZE,
+	READ_DUPLICATE_ID,
+	READ_PAYLOAD_SIZE,
+	READ_PAYLOAD,
+	READ_HOLE_SIZE,
+	SEND_ACK,
+	DONE
+};
+
+class Transfer {
+  public:
+	Transfer(int id, const TransferRequest& request, const TransferCallbacks& callbacks);
+	~Transfer();
+
+	int id() { return id_; }
+	int sock() { return sock_; }
+	bool ended() { return state_ == DONE; }
+
+	// Returns the poll events the transfer is waiting for.
+	short events();
+
+	// Makes as much progress as possible, given the poll events that occurred.
+	void handle(short revents);
+
+	// Aborts the transfer. The error is reported when it's removed from the client.
+	void fail(const std::string& error);
+
+	// Reports the end of the transfer through its on_complete callback.
+	void complete();
+
+  private:
+	void consume(const char* buf, size_t nbytes);
+	void handle_int(long long value);
+	void prepare_file();
+	bool create_file();
+	void finish_file();
+	void skip_file();
+	bool copy_duplicate(const std::string& source);
+	void next_request();
+
+	int id_;
+	TransferRequest request_;
+	TransferCallbacks callbacks_;
+
+	int sock_;
+	State state_;
+	std::string error_;
+
+	std::string out_; // Data to be sent to the server, starting at out_pos_
+	size_t out_pos_;
+	std::vector<char> in_; // Buffer for data received from the server
+
+	// Integer field being read, and how many of its bytes have been read
+	unsigned long long int_value_;
+	int int_bytes_;
+
+	size_t request_index_; // Index of the directory whose response is being read
+	int files_left_; // Number of files left in that response
+
+	std::string name_; // Name of the file being read (as sent by the server)
+	int name_size_;
+	std::string local_path_;
+	int file_fd_;
+	long long file_size_;
+	long long file_received_;
+	int payload_left_; // Bytes left in the current payload
+
+	// Local paths of the files received so far, by index (empty for skipped files)
+	std::vector<std::string> received_;
+};
+
+// Appends 'value' to 'msg' in 4 bytes (least significant byte comes first).
+static void append_int(std::string& msg, int value) {
+	for (int i = 0; i < 4; i++) {
+		msg += (char) (value >> (i * 8)) & 0xFF;
+	}
+}
+
+// Returns an error message for the system call 'call', based on errno.
+static std::string syscall_error(const std::string& call) {
+	return call + ": " + strerror(errno);
+}
+
+Transfer::Transfer(int id, const TransferRequest& request, const TransferCallbacks& callbacks)
+	: id_(id), request_(request), callbacks_(callbacks), sock_(-1), state_(CONNECTING),
+	  out_pos_(0), in_(RECV_BUFSIZE), int_value_(0), int_bytes_(0), request_index_(0),
+	  files_left_(0), name_size_(0), file_fd_(-1), file_size_(0), file_received_(0),
+	  payload_left_(0) {
+	if (request_.directories.empty()) {
+		fail("No directories were requested");
+		return;
+	}
+
+	// Requests for more than one directory are sent back to back, as a session
+	bool session = request_.directories.size() > 1;
+
+	if (request_.dedup) {
+		append_int(out_, DEDUP_MARKER);
+	}
+
+	if (session) {
+		append_int(out_, SESSION_MARKER);
+	}
+
+	for (std::string& directory : request_.directories) {
+		append_int(out_, directory.size());
+		out_ += directory;
+	}
+
+	if (session) {
+		append_int(out_, SESSION_MARKER);
+	}
+
+	struct addrinfo hints;
+	struct addrinfo* result;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+
+	int status = getaddrinfo(request_.host.c_str(), nullptr, &hints, &result);
+	if (status != 0) {
+		fail(std::string("getaddrinfo: ") + gai_strerror(status));
+		return;
+	}
+
+	struct sockaddr_in server;
+	memcpy(&server, result->ai_addr, sizeof(server));
+	server.sin_port = htons(request_.port);
+	freeaddrinfo(result);
+
+	if ((sock_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+		fail(syscall_error("socket"));
+		return;
+	}
+
+	if (connect(sock_, (struct sockaddr *) &server, sizeof(server)) < 0 && errno != EINPROGRESS) {
+		fail(syscall_error("connect"));
+	}
+}
+
+Transfer::~Transfer() {
+	if (file_fd_ >= 0) {
+		close(file_fd_);
+	}
+
+	if (sock_ >= 0) {
+		close(sock_);
+	}
+}
+
+short Transfer::events() {
+	short events = state_ == CONNECTING ? 0 : POLLIN;
+
+	if (state_ == CONNECTING || out_pos_ < out_.size()) {
+		events |= POLLOUT;
+	}
+
+	return events;
+}
+
+void Transfer::handle(short revents) {
+	if (state_ == CONNECTING && (revents & (POLLOUT | POLLERR | POLLHUP))) {
+		int error = 0;
+		socklen_t error_size = sizeof(error);
+		getsockopt(sock_, SOL_SOCKET, SO_ERROR, &error, &error_size);
+
+		if (error != 0) {
+			errno = error;
+			fail(syscall_error("connect"));
+			return;
+		}
+
+		state_ = READ_NFILES;
+	}
+
+	// Send whatever the socket can take (the requests and, eventually, the ACK)
+	if ((revents & POLLOUT) && out_pos_ < out_.size()) {
+		ssize_t nwritten = send(sock_, out_.data() + out_pos_, out_.size() - out_pos_, MSG_NOSIGNAL);
+
+		if (nwritten < 0 && errno != EAGAIN && errno != EINTR) {
+			fail(syscall_error("send"));
+			return;
+		}
+
+		out_pos_ += nwritten > 0 ? nwritten : 0;
+
+		if (state_ == SEND_ACK && out_pos_ == out_.size()) {
+			close(sock_);
+			sock_ = -1;
+			state_ = DONE;
+			return;
+		}
+	}
+
+	if (revents & (POLLIN | POLLHUP | POLLERR)) {
+		ssize_t nread = recv(sock_, in_.data(), in_.size(), 0);
+
+		if (nread < 0 && errno != EAGAIN && errno != EINTR) {
+			fail(syscall_error("recv"));
+		} else if (nread == 0) {
+			fail("Connection closed by the server in the middle of a transfer");
+		} else if (nread > 0) {
+			consume(in_.data(), nread);
+		}
+	}
+}
+
+void Transfer::fail(const std::string& error) {
+	if (state_ != DONE) {
+		error_ = error;
+		state_ = DONE;
+	}
+}
+
+void Transfer::complete() {
+	if (callbacks_.on_complete) {
+		callbacks_.on_complete(id_, error_.empty(), error_);
+	}
+}
+
+void Transfer::consume(const char* buf, size_t nbytes) {
+	while (nbytes > 0 && state_ != DONE) {
+		if (state_ == READ_NAME) {
+			size_t chunk = name_size_ - name_.size();
+			chunk = chunk < nbytes ? chunk : nbytes;
+
+			name_.append(buf, chunk);
+			buf += chunk;
+			nbytes -= chunk;
+
+			if ((int) name_.size() == name_size_) {
+				prepare_file();
+			}
+		} else if (state_ == READ_PAYLOAD) {
+			size_t chunk = payload_left_ < (long long) nbytes ? payload_left_ : nbytes;
+
+			for (size_t written = 0; written < chunk; ) {
+				ssize_t n = write(file_fd_, buf + written, chunk - written);
+
+				if (n < 0 && errno != EINTR) {
+					fail(syscall_error("write " + local_path_));
+					return;
+				}
+
+				written += n > 0 ? n : 0;
+			}
+
+			buf += chunk;
+			nbytes -= chunk;
+			payload_left_ -= chunk;
+			file_received_ += chunk;
+
+			if (callbacks_.on_progress) {
+				callbacks_.on_progress(id_, local_path_, file_received_, file_size_);
+			}
+
+			// The callback may have cancelled the transfer
+			if (state_ == DONE) {
+				return;
+			}
+
+			if (payload_left_ == 0) {
+				if (file_received_ == file_size_) {
+					finish_file();
+				} else {
+					state_ = READ_PAYLOAD_SIZE;
+				}
+			}
+		} else if (state_ == SEND_ACK) {
+			fail("Unexpected data after the end of the transfer");
+		} else {
+			// All other fields are integers (least significant byte comes first), which
+			// take up 4 bytes, except for file and hole sizes, which take up 8
+			int width = state_ == READ_FILE_SIZE || state_ == READ_HOLE_SIZE ? 8 : 4;
+
+			int_value_ |= (unsigned long long) (unsigned char) *buf << (int_bytes_ * 8);
+			buf++;
+			nbytes--;
+
+			if (++int_bytes_ == width) {
+				long long value = width == 4 ? (int) int_value_ : (long long) int_value_;
+				int_value_ = int_bytes_ = 0;
+				handle_int(value);
+			}
+		}
+	}
+}
+
+void Transfer::handle_int(long long value) {
+	switch (state_) {
+		case READ_NFILES:
+			if (value < 0) {
+				fail("Invalid number of files");
+				return;
+			}
+
+			files_left_ = value;
+
+			if (callbacks_.on_directory) {
+				callbacks_.on_directory(id_, request_.directories[request_index_], value);
+			}
+
+			if (state_ == DONE) {
+				return;
+			}
+
+			if (files_left_ == 0) {
+				next_request();
+			} else {
+				state_ = READ_NAME_SIZE;
+			}
+
+			break;
+
+		case READ_NAME_SIZE:
+			if (value <= 0 || value > PATH_MAX) {
+				fail("Invalid file name size");
+				return;
+			}
+
+			name_.clear();
+			name_size_ = value;
+			state_ = READ_NAME;
+			break;
+
+		case READ_FILE_SIZE:
+			if (value == FILE_ERROR) {
+				skip_file();
+				return;
+			}
+
+			if (value == FILE_DUPLICATE && request_.dedup) {
+				state_ = READ_DUPLICATE_ID;
+				return;
+			}
+
+			if (value < 0) {
+				fail("Invalid file size");
+				return;
+			}
+
+			file_size_ = value;
+			file_received_ = 0;
+
+			if (!create_file()) {
+				return;
+			}
+
+			if (file_size_ == 0) {
+				finish_file();
+			} else {
+				state_ = READ_PAYLOAD_SIZE;
+			}
+
+			break;
+
+		case READ_DUPLICATE_ID:
+			if (value < 0 || value >= (int) received_.size() || received_[value].empty()) {
+				fail("Invalid duplicate file index");
+				return;
+			}
+
+			if (copy_duplicate(received_[value])) {
+				finish_file();
+			}
+
+			break;
+
+		case READ_PAYLOAD_SIZE:
+			if (value == BLOCK_ERROR) {
+				skip_file();
+				return;
+			}
+
+			if (value == HOLE_MARKER) {
+				state_ = READ_HOLE_SIZE;
+				return;
+			}
+
+			if (value <= 0 || value > file_size_ - file_received_) {
+				fail("Invalid payload size");
+				return;
+			}
+
+			payload_left_ = value;
+			state_ = READ_PAYLOAD;
+			break;
+
+		case READ_HOLE_SIZE:
+			if (value <= 0 || value > file_size_ - file_received_) {
+				fail("Invalid hole size");
+				return;
+			}
+
+			// Holes are skipped over, rather than written, so that the copy stays sparse
+			if (lseek(file_fd_, value, SEEK_CUR) < 0) {
+				fail(syscall_error("lseek " + local_path_));
+				return;
+			}
+
+			file_received_ += value;
+
+			if (callbacks_.on_progress) {
+				callbacks_.on_progress(id_, local_path_, file_received_, file_size_);
+			}
+
+			if (state_ == DONE) {
+				return;
+			}
+
+			if (file_received_ < file_size_) {
+				state_ = READ_PAYLOAD_SIZE;
+				break;
+			}
+
+			// A hole at the end of the file is only there once the file is extended
+			if (ftruncate(file_fd_, file_size_) < 0) {
+				fail(syscall_error("ftruncate " + local_path_));
+				return;
+			}
+
+			finish_file();
+			break;
+
+		default:
+			break;
+	}
+}
+
+// Sets the local path of the file named 'name_' (and creates the directories along it,
+// if needed). The server sends names relative to its root, so everything up to the
+// requested directory is trimmed (unless the whole root was requested). The file itself
+// is created once its size arrives, by create_file().
+void Transfer::prepare_file() {
+	std::string& directory = request_.directories[request_index_];
+
+	size_t start = directory == "." ? 0 : name_.find(directory);
+	if (start == std::string::npos) {
+		start = 0;
+	}
+
+	std::string path = name_.substr(start);
+
+	// The names of the root's files start with "./"
+	while (path.compare(0, 2, "./") == 0) {
+		path.erase(0, 2);
+	}
+
+	// Don't let the server write outside of the destination directory
+	if (path.empty() || path[0] == '/' || path.compare(0, 3, "../") == 0
+	    || path.find("/../") != std::string::npos) {
+		fail("Invalid file name: " + name_);
+		return;
+	}
+
+	// Local paths are relative to the destination (as is, if it's the working directory)
+	local_path_ = request_.destination == "." ? path : request_.destination + "/" + path;
+
+	for (size_t pos = local_path_.size() - path.size(); ; pos++) {
+		pos = local_path_.find('/', pos);
+		if (pos == std::string::npos) {
+			break;
+		}
+
+		std::string parent = local_path_.substr(0, pos);
+		if (mkdir(parent.c_str(), 0700) < 0 && errno != EEXIST) {
+			fail(syscall_error("mkdir " + parent));
+			return;
+		}
+	}
+
+	state_ = READ_FILE_SIZE;
+}
+
+// Creates (or replaces) the local copy of the file being received. An existing file
+// is unlinked rather than truncated, since it may be a hard link to another file (see
+// TransferRequest::dedup). Returns false (and fails the transfer) on error.
+bool Transfer::create_file() {
+	if (file_fd_ >= 0) {
+		close(file_fd_);
+	}
+
+	unlink(local_path_.c_str());
+
+	if ((file_fd_ = open(local_path_.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0600)) < 0) {
+		fail(syscall_error("open " + local_path_));
+		return false;
+	}
+
+	return true;
+}
+
+void Transfer::finish_file() {
+	int status = file_fd_ >= 0 ? close(file_fd_) : 0;
+	file_fd_ = -1;
+
+	if (status < 0) {
+		fail(syscall_error("close " + local_path_));
+		return;
+	}
+
+	received_.push_back(local_path_);
+
+	if (callbacks_.on_file) {
+		callbacks_.on_file(id_, local_path_);
+	}
+
+	if (state_ == DONE) {
+		return;
+	}
+
+	if (--files_left_ == 0) {
+		next_request();
+	} else {
+		state_ = READ_NAME_SIZE;
+	}
+}
+
+// The server couldn't read the file being received, so whatever was written of its local
+// copy is discarded, and the transfer moves on to the next file.
+void Transfer::skip_file() {
+	if (file_fd_ >= 0) {
+		close(file_fd_);
+		file_fd_ = -1;
+	}
+
+	unlink(local_path_.c_str());
+
+	received_.push_back(std::string());
+
+	if (callbacks_.on_skipped) {
+		callbacks_.on_skipped(id_, local_path_);
+	}
+
+	if (state_ == DONE) {
+		return;
+	}
+
+	if (--files_left_ == 0) {
+		next_request();
+	} else {
+		state_ = READ_NAME_SIZE;
+	}
+}
+
+// Makes the file being received a copy of the local file at 'source', which has the
+// same contents. Returns false (and fails the transfer) if that's not possible.
+bool Transfer::copy_duplicate(const std::string& source) {
+	// The same file may be requested twice in a session, in which case it's in place
+	if (source == local_path_) {
+		return true;
+	}
+
+	int source_fd = open(source.c_str(), O_RDONLY);
+	if (source_fd < 0) {
+		fail(syscall_error("open " + source));
+		return false;
+	}
+
+	if (!create_file()) {
+		close(source_fd);
+		return false;
+	}
+
+	// A reflink shares the data blocks of the source, copy-on-write
+#ifdef FICLONE
+	if (ioctl(file_fd_, FICLONE, source_fd) == 0) {
+		close(source_fd);
+		return true;
+	}
+#endif
+
+	// Otherwise, the file is replaced by a hard link to the source
+	if (unlink(local_path_.c_str()) == 0 && link(source.c_str(), local_path_.c_str()) == 0) {
+		close(source_fd);
+		close(file_fd_);
+		file_fd_ = -1;
+		return true;
+	}
+
+	// As a last resort, the contents are copied
+	if (!create_file()) {
+		close(source_fd);
+		return false;
+	}
+
+	std::vector<char> buf(RECV_BUFSIZE);
+	for (ssize_t nread; (nread = read(source_fd, buf.data(), buf.size())) != 0; ) {
+		if (nread < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (nread < 0) {
+			close(source_fd);
+			fail(syscall_error("read " + source));
+			return false;
+		}
+
+		for (ssize_t written = 0; written < nread; ) {
+			ssize_t n = write(file_fd_, buf.data() + written, nread - written);
+
+			if (n < 0 && errno != EINTR) {
+				close(source_fd);
+				fail(syscall_error("write " + local_path_));
+				return false;
+			}
+
+			written += n > 0 ? n : 0;
+		}
+	}
+
+	close(source_fd);
+	return true;
+}
+
+void Transfer::next_request() {
+	if (++request_index_ < request_.directories.size()) {
+		state_ = READ_NFILES;
+		return;
+	}
+
+	// Let the server know that the transaction has been completed
+	out_ += ' ';
+	state_ = SEND_ACK;
+}
+
+TransferClient::TransferClient() : next_id_(0), polling_(false) { }
+
+TransferClient::~TransferClient() {
+	for (Transfer* transfer : transfers_) {
+		delete transfer;
+	}
+}
+
+int TransferClient::start(const TransferRequest& request, const TransferCallbacks& callbacks) {
+	transfers_.push_back(new Transfer(next_id_, request, callbacks));
+	return next_id_++;
+}
+
+void TransferClient::cancel(int id) {
+	for (Transfer* transfer : transfers_) {
+		if (transfer->id() == id) {
+			transfer->fail("Cancelled");
+		}
+	}
+}
+
+int TransferClient::poll_once(int timeout_ms) {
+	if (polling_) {
+		return transfers_.size();
+	}
+
+	std::vector<struct pollfd> fds;
+	std::vector<Transfer*> polled;
+
+	for (Transfer* transfer : transfers_) {
+		if (transfer->ended()) {
+			timeout_ms = 0; // Report it right away
+		} else {
+			struct pollfd fd = { transfer->sock(), transfer->events(), 0 };
+			fds.push_back(fd);
+			polled.push_back(transfer);
+		}
+	}
+
+	polling_ = true;
+
+	if (!fds.empty() && poll(fds.data(), fds.size(), timeout_ms) > 0) {
+		for (size_t i = 0; i < fds.size(); i++) {
+			// An earlier callback may have cancelled it
+			if (fds[i].revents != 0 && !polled[i]->ended()) {
+				polled[i]->handle(fds[i].revents);
+			}
+		}
+	}
+
+	reap();
+	polling_ = false;
+
+	return transfers_.size();
+}
+
+void TransferClient::run() {
+	while (!polling_ && poll_once(-1) > 0) { }
+}
+
+void TransferClient::reap() {
+	std::vector<Transfer*> ended;
+	std::vector<Transfer*> running;
+
+	for (Transfer* transfer : transfers_) {
+		(transfer->ended() ? ended : running).push_back(transfer);
+	}
+
+	// Callbacks may start new transfers, so the list is updated before invoking them
+	transfers_.swap(running);
+
+	for (Transfer* transfer : ended) {
+		transfer->complete();
+		delete transfer;
+	}
+}
@@ -0,0 +1,106 @@
+#ifndef TRANSFER_CLIENT_H_
+#define TRANSFER_CLIENT_H_
+
+#include <string>
+#include <vector>
+#include <functional>
+
+// Client library for the remote file transfer protocol (libremoteclient.a / .so).
+//
+// A TransferClient drives any number of concurrent transfers from a single event loop,
+// using non-blocking sockets. Nothing is ever fatal: errors are reported through the
+// transfer's callbacks, and only the transfer they occurred in is aborted.
+//
+//   TransferClient client;
+//   TransferCallbacks callbacks;
+//   callbacks.on_complete = [](int id, bool ok, const std::string& error) { ... };
+//
+//   client.start(request, callbacks);
+//   client.run(); // Or call poll_once() from your own loop
+//
+// Every method may be called from within a callback, e.g. to cancel a transfer from its
+// on_progress, or to start another one from on_complete. Calls to poll_once() or run()
+// from a callback return right away, since the event loop is already running.
+//
+// Note: host names are resolved (and local files are written) synchronously.
+
+// What to transfer, from where and to where.
+struct TransferRequest {
+	std::string host;
+	int port;
+
+	// Directories (or single files) to copy, relative to the server's root. More than
+	// one of them are requested in a single session (over the same connection).
+	std::vector<std::string> directories;
+
+	// Local directory that the files are replicated into (it must exist).
+	std::string destination;
+
+	// Asks the server to send files with the same contents as an earlier file of the
+	// transfer as references to it. Their local copies are then made from the earlier
+	// file: as reflinks where the file system supports them, else as hard links (or, if
+	// neither works, as plain copies).
+	bool dedup;
+
+	TransferRequest() : port(0), destination("."), dedup(false) { }
+};
+
+// Callbacks of a transfer, all of which are optional. They're invoked from within
+// poll_once() (or run()), and they receive the id that start() returned.
+struct TransferCallbacks {
+	// The server is about to send the 'nfiles' files under 'directory'.
+	std::function<void(int id, const std::string& directory, int nfiles)> on_directory;
+
+	// 'received' out of 'size' bytes of the file at (local) 'path' have been written.
+	std::function<void(int id, const std::string& path, long long received, long long size)> on_progress;
+
+	// The file at (local) 'path' has been received in full.
+	std::function<void(int id, const std::string& path)> on_file;
+
+	// The server couldn't read the file at (local) 'path', so it was left out (and its
+	// partial local copy removed). The rest of the transfer carries on.
+	std::function<void(int id, const std::string& path)> on_skipped;
+
+	// The transfer has ended, successfully or not (in which case 'error' describes why).
+	std::function<void(int id, bool ok, const std::string& error)> on_complete;
+};
+
+class Transfer;
+
+class TransferClient {
+  public:
+	TransferClient();
+	~TransferClient(); // Aborts any transfers still in progress (without callbacks)
+
+	TransferClient(const TransferClient&) = delete;
+	TransferClient& operator=(const TransferClient&) = delete;
+
+	// Starts a transfer and returns its id. It only initiates the connection, so errors
+	// are reported (through on_complete) by a later poll_once().
+	int start(const TransferRequest& request, const TransferCallbacks& callbacks);
+
+	// Aborts the transfer with the given id. Its on_complete callback is invoked by the
+	// next poll_once().
+	void cancel(int id);
+
+	// Waits up to 'timeout_ms' milliseconds (-1 waits indefinitely) for any of the
+	// transfers to make progress, and processes whatever is ready. Returns the number
+	// of transfers that are still in progress.
+	int poll_once(int timeout_ms);
+
+	// Runs the event loop until all transfers have ended.
+	void run();
+
+	// Returns the number of transfers in progress.
+	int active() { return transfers_.size(); }
+
+  private:
+	// Removes ended transfers, invoking their on_complete callbacks.
+	void reap();
+
+	int next_id_;
+	std::vector<Transfer*> transfers_;
+	bool polling_; // Inside poll_once(), so a nested call does nothing
+};
+
+#endif // TRANSFER_CLIENT_H_
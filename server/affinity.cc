@@ -0,0 +1,155 @@
+#include "affinity.h"
+
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <fstream>
+
+extern "C" {
+	#include <sched.h>
+}
+
+// Each NUMA node lists its CPUs under this directory, in /nodeN/cpulist
+#define NODE_DIR "/sys/devices/system/node"
+
+bool parse_pin_mode(const std::string& arg, PinMode* mode) {
+	if (arg.empty() || arg == "none") {
+		*mode = PIN_NONE;
+	} else if (arg == "core") {
+		*mode = PIN_CORE;
+	} else if (arg == "numa") {
+		*mode = PIN_NUMA;
+	} else {
+		return false;
+	}
+
+	return true;
+}
+
+// Reads a CPU list of the form "0-7,16-23" from 'path' into 'cpus'.
+static bool read_cpu_list(const std::string& path, cpu_set_t* cpus) {
+	std::ifstream file(path.c_str());
+	std::string list;
+
+	if (!std::getline(file, list)) {
+		return false;
+	}
+
+	CPU_ZERO(cpus);
+
+	for (size_t pos = 0; pos < list.size(); ) {
+		size_t end = list.find(',', pos);
+		if (end == std::string::npos) {
+			end = list.size();
+		}
+
+		std::string range = list.substr(pos, end - pos);
+		size_t dash = range.find('-');
+
+		int first = atoi(range.c_str());
+		int last = dash == std::string::npos ? first : atoi(range.c_str() + dash + 1);
+
+		for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+			CPU_SET(cpu, cpus);
+		}
+
+		pos = end + 1;
+	}
+
+	return CPU_COUNT(cpus) > 0;
+}
+
+// Returns the CPUs of each NUMA node, restricted to the ones the process may run on.
+static std::vector<cpu_set_t> numa_nodes(const cpu_set_t& allowed) {
+	std::vector<cpu_set_t> nodes;
+
+	cpu_set_t cpus;
+	for (int node = 0; true; node++) {
+		std::string path = NODE_DIR "/node" + std::to_string(node) + "/cpulist";
+		if (!read_cpu_list(path, &cpus)) {
+			break;
+		}
+
+		CPU_AND(&cpus, &cpus, &allowed);
+		if (CPU_COUNT(&cpus) > 0) {
+			nodes.push_back(cpus);
+		}
+	}
+
+	if (nodes.empty()) {
+		nodes.push_back(allowed);
+	}
+
+	return nodes;
+}
+
+int numa_node_count() {
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+		return 1;
+	}
+
+	return numa_nodes(allowed).size();
+}
+
+std::vector<cpu_set_t> partition_cpus(PinMode mode, int ngroups) {
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+		CPU_ZERO(&allowed);
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			CPU_SET(cpu, &allowed);
+		}
+	}
+
+	std::vector<cpu_set_t> groups(ngroups);
+
+	if (mode == PIN_NONE) {
+		for (int i = 0; i < ngroups; i++) {
+			groups[i] = allowed;
+		}
+	} else if (mode == PIN_NUMA) {
+		// Nodes are dealt to groups round robin, so a group never spans a node partially
+		std::vector<cpu_set_t> nodes = numa_nodes(allowed);
+
+		for (int i = 0; i < ngroups; i++) {
+			CPU_ZERO(&groups[i]);
+		}
+
+		int nnodes = nodes.size();
+		for (int i = 0; i < (ngroups > nnodes ? ngroups : nnodes); i++) {
+			cpu_set_t* group = &groups[i % ngroups];
+			CPU_OR(group, group, &nodes[i % nnodes]);
+		}
+	} else {
+		// Each group gets a contiguous slice of the allowed CPUs
+		int ncpus = CPU_COUNT(&allowed);
+
+		for (int i = 0; i < ngroups; i++) {
+			CPU_ZERO(&groups[i]);
+		}
+
+		if (ngroups <= ncpus) {
+			for (int i = 0; i < ncpus; i++) {
+				CPU_SET(nth_cpu(allowed, i), &groups[(long long) i * ngroups / ncpus]);
+			}
+		} else {
+			for (int i = 0; i < ngroups; i++) {
+				CPU_SET(nth_cpu(allowed, i), &groups[i]);
+			}
+		}
+	}
+
+	return groups;
+}
+
+int nth_cpu(const cpu_set_t& cpus, int i) {
+	i %= CPU_COUNT(&cpus);
+
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, &cpus) && i-- == 0) {
+			return cpu;
+		}
+	}
+
+	return 0;
+}
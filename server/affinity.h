@@ -0,0 +1,34 @@
+#ifndef AFFINITY_H_
+#define AFFINITY_H_
+
+#include <string>
+#include <vector>
+
+extern "C" {
+	#include <sched.h>
+}
+
+// How the server's threads are placed on CPUs (-c option):
+//  - none: threads run wherever the scheduler puts them
+//  - core: each worker group gets a slice of the CPUs, and each worker gets one of them
+//  - numa: each worker group gets a set of NUMA nodes (one group per node by default),
+//          and its threads may run on any CPU of them
+// Either way, buffers are allocated by the threads that use them, so they're placed
+// on the local node under the default (first-touch) memory policy.
+
+enum PinMode { PIN_NONE, PIN_CORE, PIN_NUMA };
+
+// Parses the argument of -c. Returns false if it's not one of the modes above.
+bool parse_pin_mode(const std::string& arg, PinMode* mode);
+
+// Returns the number of NUMA nodes (1, if the topology can't be read).
+int numa_node_count();
+
+// Splits the CPUs the process may run on into 'ngroups' sets, according to 'mode'.
+// If there are fewer CPUs (or nodes) than groups, some groups share them.
+std::vector<cpu_set_t> partition_cpus(PinMode mode, int ngroups);
+
+// Returns the i-th CPU of 'cpus', wrapping around if there are fewer than i + 1.
+int nth_cpu(const cpu_set_t& cpus, int i);
+
+#endif // AFFINITY_H_
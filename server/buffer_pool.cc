@@ -0,0 +1,33 @@
+#include "buffer_pool.h"
+
+#include <vector>
+
+size_t BufferPool::buffer_size_ = 0;
+
+// Free buffers of the calling thread, which are deallocated when the thread exits
+struct FreeList {
+	std::vector<char*> buffers;
+
+	~FreeList() {
+		for (char* buf : buffers) {
+			delete[] buf;
+		}
+	}
+};
+
+static thread_local FreeList free_list;
+
+char* BufferPool::acquire() {
+	if (free_list.buffers.empty()) {
+		return new char[buffer_size_];
+	}
+
+	char* buf = free_list.buffers.back();
+	free_list.buffers.pop_back();
+
+	return buf;
+}
+
+void BufferPool::release(char* buf) {
+	free_list.buffers.push_back(buf);
+}
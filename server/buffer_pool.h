@@ -0,0 +1,28 @@
+#ifndef BUFFER_POOL_H_
+#define BUFFER_POOL_H_
+
+#include <cstddef>
+
+// Pool of fixed-size buffers that blocks are read into before being sent. Each thread
+// keeps its own freelist, so buffers are recycled without any locking, and since a
+// buffer is first touched by the thread that allocated it, it's placed on that thread's
+// NUMA node (under the default first-touch policy) and stays there.
+
+class BufferPool {
+  public:
+	// Sets the size of the buffers handed out by the pool. It must be called once,
+	// before any thread acquires a buffer.
+	static void set_buffer_size(size_t size) { buffer_size_ = size; }
+
+	static size_t buffer_size() { return buffer_size_; }
+
+	// Returns a buffer of buffer_size() bytes, reusing one of the thread's free buffers
+	// if there is any. Buffers must be released by the same thread that acquired them.
+	static char* acquire();
+	static void release(char* buf);
+
+  private:
+	static size_t buffer_size_;
+};
+
+#endif // BUFFER_POOL_H_
@@ -1,9 +1,10 @@
 #include "threads.h"
 
-#include <map>
-#include <queue>
+#include <cerrno>
+#include <climits>
 #include <string>
-#include <vector>
+#include <cstring>
+#include <utility>
 #include <iostream>
 
 extern "C" {
@@ -15,38 +16,110 @@ extern "C" {
 }
 
 #include "reader.h"
+#include "protocol.h"
 #include "syscall_utils.h"
 
-static std::string read_dirname(Reader& reader) {
-	// Read the directory that the client wants to copy. The first 4 bytes
-	// are the payload's size in bytes (least significant byte comes first)
+Connection::Connection(int _fd, WorkerGroup* _group, int block_size)
+	: fd(_fd), group(_group), dedup(false), broken(false), bytes_sent(0), files_sent(0),
+	  pending(0), next_file_id(0),
+	  controller(block_size), refs_(1) {
+	int status = pthread_mutex_init(&send_mutex, nullptr);
+	pthread_call_or_exit(status, "pthread_mutex_init (send_mutex)");
 
-	int nbytes = 0;
+	status = pthread_cond_init(&cond_sent, nullptr);
+	pthread_call_or_exit(status, "pthread_cond_init (cond_sent)");
+
+	status = pthread_mutex_lock(&data.conn_mutex);
+	pthread_call_or_exit(status, "pthread_mutex_lock (conn_mutex)");
+
+	data.nconnections++;
+
+	status = pthread_mutex_unlock(&data.conn_mutex);
+	pthread_call_or_exit(status, "pthread_mutex_unlock (conn_mutex)");
+}
+
+Connection::~Connection() {
+	int status = pthread_mutex_destroy(&send_mutex);
+	pthread_call_or_exit(status, "pthread_mutex_destroy (send_mutex)");
+
+	status = pthread_cond_destroy(&cond_sent);
+	pthread_call_or_exit(status, "pthread_cond_destroy (cond_sent)");
+
+	close(fd);
+
+	// Let the main thread know if the server has become idle (it may be draining)
+	status = pthread_mutex_lock(&data.conn_mutex);
+	pthread_call_or_exit(status, "pthread_mutex_lock (conn_mutex)");
+
+	if (--data.nconnections == 0) {
+		status = pthread_cond_broadcast(&data.cond_idle);
+		pthread_call_or_exit(status, "pthread_cond_broadcast (cond_idle)");
+	}
+
+	status = pthread_mutex_unlock(&data.conn_mutex);
+	pthread_call_or_exit(status, "pthread_mutex_unlock (conn_mutex)");
+}
+
+// Reads a 4-byte integer (least significant byte comes first).
+static int read_int(Reader& reader) {
+	int value = 0;
 	for (int byte, i = 0; i < 4; i++) {
 		byte = reader.next();
-		nbytes |= byte << (i * 8);
+		value |= byte << (i * 8);
 	}
 
-	// Create the target directory path as per the client's request
-	std::string dirname(STARTDIR);
+	return value;
+}
+
+// Reads the path that the client wants to copy (a directory or a single file), whose
+// name is 'nbytes' long, into 'path'. Returns false if the client left before sending
+// all of it.
+static bool read_path(Reader& reader, int nbytes, std::string& path) {
+	// Create the target path as per the client's request
+	path = STARTDIR;
 	for (int i = 0; i < nbytes; i++) {
-		dirname += (char) reader.next();
+		int byte = reader.next();
+		if (byte < 0) {
+			return false;
+		}
+
+		path += (char) byte;
 	}
 
 	// If the client selected the default directory, omit the "." in the path
-	if (dirname.back() == '.') {
-		dirname = std::string(STARTDIR);
+	if (path == STARTDIR ".") {
+		path = std::string(STARTDIR);
 	}
 
-	// Add a trailing slash if it's not there (needed for process_directory)
-	if (dirname.back() != '/') {
-		dirname += '/';
-	}
+	return true;
+}
+
+// Marks the connection as broken, so that the rest of the client's files are skipped.
+static void break_connection(Connection* conn) {
+	int status = pthread_mutex_lock(&conn->send_mutex);
+	pthread_call_or_exit(status, "pthread_mutex_lock (send_mutex)");
 
-	return dirname;
+	conn->broken = true;
+
+	status = pthread_mutex_unlock(&conn->send_mutex);
+	pthread_call_or_exit(status, "pthread_mutex_unlock (send_mutex)");
 }
 
-static void process_directory(std::string& dirname, std::vector<std::string>& filenames) {
+static bool is_broken(Connection* conn) {
+	int status = pthread_mutex_lock(&conn->send_mutex);
+	pthread_call_or_exit(status, "pthread_mutex_lock (send_mutex)");
+
+	bool broken = conn->broken;
+
+	status = pthread_mutex_unlock(&conn->send_mutex);
+	pthread_call_or_exit(status, "pthread_mutex_unlock (send_mutex)");
+
+	return broken;
+}
+
+// Adds the paths of all files under 'dirname' to 'paths'. The same string is used to
+// build every path in the scan, and it's restored to 'dirname' before returning.
+static void process_directory(std::string& dirname, PathArena& paths) {
 	DIR* dp = opendir(dirname.c_str());
 
 	if (dp == nullptr) {
@@ -62,110 +135,246 @@ static void process_directory(std::string& dirname, std::vector<std::string>& fi
 		return;
 	}
 
+	size_t dirname_size = dirname.size();
+
 	for (struct dirent* direntp; (direntp = readdir(dp)) != nullptr; ) {
-		std::string entry_name = direntp->d_name;
+		const char* entry_name = direntp->d_name;
 
 		// Avoid current and parent directory entries so as to not create cycles
-		if (entry_name != "." && entry_name != "..") {
-			entry_name = dirname + entry_name;
+		if (strcmp(entry_name, ".") != 0 && strcmp(entry_name, "..") != 0) {
+			dirname.resize(dirname_size);
+			dirname += entry_name;
 
+			// The entry may have been removed since it was read, in which case it's skipped
 			struct stat st_buf;
-			call_or_exit(stat(entry_name.c_str(), &st_buf), "stat (communication thread)");
+			if (stat(dirname.c_str(), &st_buf) < 0) {
+				int status = pthread_mutex_lock(&data.log_mutex);
+				pthread_call_or_exit(status, "pthread_mutex_lock (log_mutex)");
+
+				std::cerr << "[Thread " << pthread_self()
+				          << "]: Skipping " << dirname << ": " << strerror(errno) << "\n";
+
+				status = pthread_mutex_unlock(&data.log_mutex);
+				pthread_call_or_exit(status, "pthread_mutex_unlock (log_mutex)");
+
+				continue;
+			}
 
 			if (S_ISDIR(st_buf.st_mode)) {
-				entry_name += "/";
-				process_directory(entry_name, filenames);
+				dirname += "/";
+				process_directory(dirname, paths);
 			} else {
-				filenames.push_back(entry_name);
+				paths.add(dirname);
 			}
 		}
 	}
 
-	call_or_exit(closedir(dp), "closedir (communication thread)");
-}
-
-void* communication_thread(void* arg) {
-	int fd = *((int *) arg);
-	delete (int *) arg;
+	dirname.resize(dirname_size);
 
-	Reader reader(fd);
-	std::string dirname = read_dirname(reader);
+	closedir(dp);
+}
 
-	int status = pthread_mutex_lock(&data.log_mutex);
-	pthread_call_or_exit(status, "pthread_mutex_lock (log_mutex)");
+// Serves a request whose paths have been scanned into 'scanned'. Waits until all files
+// of the previous request (if any) have been sent, so that the client receives the
+// responses in order. On return, 'scanned' holds the previous request's paths, which
+// aren't needed anymore. Returns false if the connection to the client is broken.
+// Note: this is a barrier, so the workers can't send one request's files while the
+// previous request's last ones are still being sent.
+static bool process_request(Connection* conn, PathArena& scanned) {
+	WorkerGroup* group = conn->group;
+
+	int status = pthread_mutex_lock(&conn->send_mutex);
+	pthread_call_or_exit(status, "pthread_mutex_lock (send_mutex)");
+
+	while (conn->pending > 0) {
+		status = pthread_cond_wait(&conn->cond_sent, &conn->send_mutex);
+		pthread_call_or_exit(status, "pthread_cond_wait (cond_sent, send_mutex)");
+	}
 
-	std::cerr << "[Thread " << pthread_self()
-	          << "]: About to scan directory " << dirname << "\n";
+	// The tasks of the previous request are all done, so its paths can be replaced
+	std::swap(conn->paths, scanned);
+	conn->pending = conn->paths.size();
 
-	status = pthread_mutex_unlock(&data.log_mutex);
-	pthread_call_or_exit(status, "pthread_mutex_unlock (log_mutex)");
+	// Tell the client know how many files he's about to receive
+	char msg[4];
+	for (int i = 0, n_files = conn->paths.size(); i < 4; i++) {
+		msg[i] = (char) (n_files >> (i * 8)) & 0xFF;
+	}
 
-	// Scan the target directory and add all file names in 'filenames'
-	std::vector<std::string> filenames; // All filenames under the directory
-	process_directory(dirname, filenames);
+	if (!conn->broken && write_(conn->fd, msg, sizeof(msg)) < 0) {
+		conn->broken = true;
+	}
 
-	// Tell the client know how many files he's about to receive
-	std::string msg = "";
-	for (int i = 0, n_files = filenames.size(); i < 4; i++) {
-		msg += (char) (n_files >> (i * 8)) & 0xFF;
+	bool broken = conn->broken;
+	if (broken) {
+		conn->pending = 0;
 	}
 
-	call_or_exit(write_(fd, msg.c_str(), msg.size()), "write_ (communication thread)");
+	status = pthread_mutex_unlock(&conn->send_mutex);
+	pthread_call_or_exit(status, "pthread_mutex_unlock (send_mutex)");
 
-	// Create a lock for the client's socket
-	data.fd_to_mutex[fd] = new pthread_mutex_t();
-	pthread_mutex_init(data.fd_to_mutex[fd], nullptr);
+	scanned.clear();
+
+	if (broken) {
+		return false;
+	}
 
 	// Create all needed tasks to delegate to the worker threads
-	for (std::string filename : filenames) {
+	for (size_t i = 0; i < conn->paths.size(); i++) {
+		const char* filename = conn->paths.path(i);
+
 		status = pthread_mutex_lock(&data.log_mutex);
 		pthread_call_or_exit(status, "pthread_mutex_lock (log_mutex)");
 
 		std::cerr << "[Thread " << pthread_self()
-		          << "]: Adding file " + filename + " to the queue...\n";
+		          << "]: Adding file " << filename << " to the queue...\n";
 
 		status = pthread_mutex_unlock(&data.log_mutex);
 		pthread_call_or_exit(status, "pthread_mutex_unlock (log_mutex)");
 
 		// Create new task to add to the task queue, unless it's at max capacity
-		status = pthread_mutex_lock(&data.queue_mutex);
+		status = pthread_mutex_lock(&group->queue_mutex);
 		pthread_call_or_exit(status, "pthread_mutex_lock (queue_mutex)");
 
-		while (((int) data.tasks.size()) > data.task_capacity) {
-			status = pthread_cond_wait(&data.cond_nonfull, &data.queue_mutex);
+		while (((int) group->tasks.size()) > data.task_capacity) {
+			status = pthread_cond_wait(&group->cond_nonfull, &group->queue_mutex);
 			pthread_call_or_exit(status, "pthread_cond_wait (cond_nonfull, queue_mutex)");
 		}
 
-		data.tasks.push(Task(fd, filename));
+		conn->acquire(); // Dropped by the worker thread, once the file is transferred
+		group->tasks.push(Task(conn, filename, conn->paths.path_size(i)));
 
 		// Broadcast to worker threads that a new task is available in the task queue
-		status = pthread_cond_broadcast(&data.cond_nonempty);
+		status = pthread_cond_broadcast(&group->cond_nonempty);
 		pthread_call_or_exit(status, "pthread_cond_broadcast (cond_nonempty)");
 
-		status = pthread_mutex_unlock(&data.queue_mutex);
+		status = pthread_mutex_unlock(&group->queue_mutex);
 		pthread_call_or_exit(status, "pthread_mutex_unlock (queue_mutex)");
 	}
 
-	// Block until one byte is received from the client as an ACK (finished) response
-	reader.next();
+	return true;
+}
+
+// Reads the next request's directory and scans it into 'scanned'. Returns false if
+// there are no more requests: a single request was served, or the session has ended.
+static bool scan_next_request(Connection* conn, Reader& reader, bool& session, int& nrequests,
+                              PathArena& scanned) {
+	if (nrequests > 0 && !session) {
+		return false;
+	}
 
-	status = pthread_mutex_lock(&data.log_mutex);
+	int nbytes = read_int(reader);
+
+	// The client may ask for duplicate files to be sent as references, before anything else
+	if (nrequests == 0 && nbytes == DEDUP_MARKER) {
+		conn->dedup = true;
+		nbytes = read_int(reader);
+	}
+
+	// A session starts with a marker in place of the first request's name size
+	if (nrequests == 0 && nbytes == SESSION_MARKER) {
+		session = true;
+		nbytes = read_int(reader);
+	}
+
+	if (nbytes == SESSION_MARKER || reader.eof()) {
+		return false;
+	}
+
+	// Anything else that isn't a valid name size means the client doesn't speak the
+	// protocol (or has gone mad), so it's dropped rather than trusted with an allocation
+	std::string path;
+	if (nbytes < 0 || nbytes > PATH_MAX || !read_path(reader, nbytes, path)) {
+		int status = pthread_mutex_lock(&data.log_mutex);
+		pthread_call_or_exit(status, "pthread_mutex_lock (log_mutex)");
+
+		std::cerr << "[Thread " << pthread_self()
+		          << "]: Invalid request (name size " << nbytes << "), dropping the client\n";
+
+		status = pthread_mutex_unlock(&data.log_mutex);
+		pthread_call_or_exit(status, "pthread_mutex_unlock (log_mutex)");
+
+		break_connection(conn);
+		return false;
+	}
+
+	nrequests++;
+
+	// A request names either a directory, all of whose files are sent, or a single file.
+	// Anything that doesn't exist is treated as a directory, which gets no files
+	struct stat st_buf;
+	bool single_file = stat(path.c_str(), &st_buf) == 0 && !S_ISDIR(st_buf.st_mode);
+
+	int status = pthread_mutex_lock(&data.log_mutex);
 	pthread_call_or_exit(status, "pthread_mutex_lock (log_mutex)");
 
 	std::cerr << "[Thread " << pthread_self()
-	          << "]: Transaction completed successfully, terminating...\n";
+	          << (single_file ? "]: About to send file " : "]: About to scan directory ")
+	          << path << "\n";
 
 	status = pthread_mutex_unlock(&data.log_mutex);
 	pthread_call_or_exit(status, "pthread_mutex_unlock (log_mutex)");
 
-	// Do some cleanup since the transfer has been completed
-	status = pthread_mutex_destroy(data.fd_to_mutex[fd]);
-	pthread_call_or_exit(status, "pthread_mutex_destroy (socket mutex)");
+	if (single_file) {
+		scanned.add(path);
+		return true;
+	}
+
+	// Add a trailing slash if it's not there (needed for process_directory)
+	if (path.back() != '/') {
+		path += '/';
+	}
+
+	// Scan the target directory and add all file names in the path arena
+	process_directory(path, scanned);
+
+	return true;
+}
 
-	delete data.fd_to_mutex[fd];
-	data.fd_to_mutex.erase(fd);
+void* communication_thread(void* arg) {
+	// The socket is closed once both this thread and all of the client's tasks are done
+	Connection* conn = (Connection *) arg;
+	Reader reader(conn->fd);
+
+	// A connection carries either a single request, or a session: many requests sent
+	// back to back. Each request is scanned while the previous one is being transferred
+	bool session = false;
+	int nrequests = 0;
+	PathArena scanned;
+
+	while (scan_next_request(conn, reader, session, nrequests, scanned)
+	       && process_request(conn, scanned)) { }
+
+	// Block until one byte is received from the client as an ACK (finished) response,
+	// unless the connection is broken: the client is gone, or it sent an invalid request
+	if (!is_broken(conn)) {
+		reader.next();
+	}
+
+	// Unless the connection broke, every task has been processed by now, since the
+	// client received all of the files
+	int status = pthread_mutex_lock(&conn->send_mutex);
+	pthread_call_or_exit(status, "pthread_mutex_lock (send_mutex)");
+
+	long long bytes_sent = conn->bytes_sent;
+	int files_sent = conn->files_sent;
+	bool broken = conn->broken || reader.eof();
+
+	status = pthread_mutex_unlock(&conn->send_mutex);
+	pthread_call_or_exit(status, "pthread_mutex_unlock (send_mutex)");
+
+	status = pthread_mutex_lock(&data.log_mutex);
+	pthread_call_or_exit(status, "pthread_mutex_lock (log_mutex)");
+
+	std::cerr << "[Thread " << pthread_self()
+	          << (broken ? "]: Transaction aborted (" : "]: Transaction completed successfully (")
+	          << nrequests << " requests, " << files_sent << " files, " << bytes_sent
+	          << " bytes), terminating...\n";
+
+	status = pthread_mutex_unlock(&data.log_mutex);
+	pthread_call_or_exit(status, "pthread_mutex_unlock (log_mutex)");
 
-	call_or_exit(close(fd), "close (communication thread");
+	conn->release();
 
 	return nullptr;
 }
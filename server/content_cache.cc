@@ -0,0 +1,171 @@
+#include "content_cache.h"
+
+#include <cerrno>
+#include <cstring>
+#include <unordered_map>
+
+extern "C" {
+	#include <unistd.h>
+	#include <pthread.h>
+	#include <sys/types.h>
+}
+
+#include "syscall_utils.h"
+
+// The cache is simply emptied when it grows past this many files
+#define MAX_CACHED_FILES (1 << 16)
+
+struct FileKey {
+	dev_t dev;
+	ino_t ino;
+
+	bool operator==(const FileKey& other) const { return dev == other.dev && ino == other.ino; }
+};
+
+struct FileKeyHash {
+	size_t operator()(const FileKey& key) const { return key.ino * 31 + key.dev; }
+};
+
+struct CachedHash {
+	off_t size;
+	struct timespec mtime;
+	uint64_t hash;
+};
+
+static std::unordered_map<FileKey, CachedHash, FileKeyHash> cache;
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Reads up to 'nbytes' at 'offset' of the file that 'fd' refers to, retrying short
+// reads. Returns the number of bytes read (fewer only at end of file), or -1.
+static ssize_t pread_(int fd, char* buf, size_t nbytes, off_t offset) {
+	size_t total = 0;
+
+	while (total < nbytes) {
+		ssize_t nread = pread(fd, buf + total, nbytes - total, offset + total);
+
+		if (nread < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return -1;
+		} else if (nread == 0) {
+			break;
+		}
+
+		total += nread;
+	}
+
+	return total;
+}
+
+// Folds 8 bytes into 'h'. Words are mixed with multiply-rotate steps, which is fast and
+// spreads every input bit across the result (collisions are ruled out by comparing).
+static uint64_t mix(uint64_t h, uint64_t word) {
+	h ^= word * 0x9E3779B97F4A7C15ULL;
+	h = (h << 31) | (h >> 33);
+	return h * 0xC2B2AE3D27D4EB4FULL;
+}
+
+static bool compute_hash(int fd, off_t size, char* buf, size_t bufsize, uint64_t* hash) {
+	// Reads are a multiple of 8 bytes, so that words never straddle two of them
+	bufsize &= ~(size_t) 7;
+
+	uint64_t h = size;
+
+	for (off_t offset = 0; offset < size; ) {
+		size_t nbytes = size - offset < (off_t) bufsize ? size - offset : bufsize;
+
+		ssize_t nread = pread_(fd, buf, nbytes, offset);
+		if (nread < (ssize_t) nbytes) {
+			return false;
+		}
+
+		size_t i = 0;
+		for (; i + 8 <= nbytes; i += 8) {
+			uint64_t word;
+			memcpy(&word, buf + i, 8);
+			h = mix(h, word);
+		}
+
+		if (i < nbytes) {
+			uint64_t word = 0;
+			memcpy(&word, buf + i, nbytes - i);
+			h = mix(h, word);
+		}
+
+		offset += nbytes;
+	}
+
+	*hash = h ^ (h >> 29);
+	return true;
+}
+
+bool ContentCache::lookup(dev_t dev, ino_t ino, off_t size, const struct timespec& mtime, uint64_t* hash) {
+	FileKey key = { dev, ino };
+
+	int status = pthread_mutex_lock(&cache_mutex);
+	pthread_call_or_exit(status, "pthread_mutex_lock (cache_mutex)");
+
+	auto entry = cache.find(key);
+	bool cached = entry != cache.end()
+	              && entry->second.size == size
+	              && entry->second.mtime.tv_sec == mtime.tv_sec
+	              && entry->second.mtime.tv_nsec == mtime.tv_nsec;
+
+	if (cached) {
+		*hash = entry->second.hash;
+	}
+
+	status = pthread_mutex_unlock(&cache_mutex);
+	pthread_call_or_exit(status, "pthread_mutex_unlock (cache_mutex)");
+
+	return cached;
+}
+
+bool ContentCache::hash(int fd, const struct stat& st, char* buf, size_t bufsize, uint64_t* hash) {
+	if (lookup(st.st_dev, st.st_ino, st.st_size, st.st_mtim, hash)) {
+		return true;
+	}
+
+	FileKey key = { st.st_dev, st.st_ino };
+
+	// The file is hashed without holding the lock, so other files can be looked up
+	if (!compute_hash(fd, st.st_size, buf, bufsize, hash)) {
+		return false;
+	}
+
+	int status = pthread_mutex_lock(&cache_mutex);
+	pthread_call_or_exit(status, "pthread_mutex_lock (cache_mutex)");
+
+	if (cache.size() >= MAX_CACHED_FILES) {
+		cache.clear();
+	}
+
+	CachedHash value = { st.st_size, st.st_mtim, *hash };
+	cache[key] = value;
+
+	status = pthread_mutex_unlock(&cache_mutex);
+	pthread_call_or_exit(status, "pthread_mutex_unlock (cache_mutex)");
+
+	return true;
+}
+
+bool ContentCache::same_contents(int fd1, int fd2, long long size, char* buf, size_t bufsize) {
+	// Each file gets half of the buffer
+	size_t half = bufsize / 2;
+
+	for (long long offset = 0; offset < size; ) {
+		size_t nbytes = size - offset < (long long) half ? size - offset : half;
+
+		if (pread_(fd1, buf, nbytes, offset) < (ssize_t) nbytes
+		    || pread_(fd2, buf + half, nbytes, offset) < (ssize_t) nbytes
+		    || memcmp(buf, buf + half, nbytes) != 0) {
+			return false;
+		}
+
+		offset += nbytes;
+	}
+
+	return true;
+}
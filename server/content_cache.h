@@ -0,0 +1,33 @@
+#ifndef CONTENT_CACHE_H_
+#define CONTENT_CACHE_H_
+
+#include <cstddef>
+#include <cstdint>
+
+extern "C" {
+	#include <sys/stat.h>
+}
+
+// Content hashes of files, used to find duplicates when a client asks for them to be
+// deduplicated. Hashes are cached by inode, and a cached hash is reused as long as the
+// file's size and modification time are unchanged, so unchanged files are read once.
+// The hash isn't cryptographic: files with equal hashes are compared byte by byte.
+
+class ContentCache {
+  public:
+	// Sets '*hash' to the hash of the file that 'fd' (described by 'st') refers to. If
+	// it isn't cached, the file is read through 'buf' ('bufsize' bytes) without moving
+	// its offset. Returns false if reading the file fails.
+	static bool hash(int fd, const struct stat& st, char* buf, size_t bufsize, uint64_t* hash);
+
+	// Sets '*hash' to the cached hash of the file with the given inode, as long as its
+	// size and modification time were the given ones when it was hashed. Returns false
+	// if there's no such hash. The file isn't touched.
+	static bool lookup(dev_t dev, ino_t ino, off_t size, const struct timespec& mtime, uint64_t* hash);
+
+	// Returns whether the first 'size' bytes of the files that 'fd1' and 'fd2' refer to
+	// are equal, reading them through 'buf' ('bufsize' bytes). Offsets aren't moved.
+	static bool same_contents(int fd1, int fd2, long long size, char* buf, size_t bufsize);
+};
+
+#endif // CONTENT_CACHE_H_
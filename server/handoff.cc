@@ -0,0 +1,129 @@
+#include "handoff.h"
+
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <cstring>
+
+extern "C" {
+	#include <unistd.h>
+	#include <sys/un.h>
+	#include <sys/types.h>
+	#include <sys/socket.h>
+}
+
+#include "syscall_utils.h"
+
+static void make_address(const std::string& path, struct sockaddr_un* addr) {
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	strncpy(addr->sun_path, path.c_str(), sizeof(addr->sun_path) - 1);
+}
+
+int receive_listeners(const std::string& path, std::vector<int>* fds) {
+	int sock;
+	call_or_exit(sock = socket(AF_UNIX, SOCK_STREAM, 0), "socket (handoff)");
+
+	struct sockaddr_un addr;
+	make_address(path, &addr);
+
+	if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		call_or_exit(close(sock), "close (handoff)");
+		return -1;
+	}
+
+	// The old server sends the number of sockets, with the sockets attached to it
+	int count = 0;
+	struct iovec iov = { &count, sizeof(count) };
+
+	char control[CMSG_SPACE(sizeof(int) * MAX_LISTENERS)];
+	struct msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	ssize_t nread;
+	do {
+		nread = recvmsg(sock, &msg, 0);
+	} while (nread < 0 && errno == EINTR);
+
+	call_or_exit(nread, "recvmsg (handoff)");
+
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	if (nread != sizeof(count) || cmsg == nullptr || cmsg->cmsg_type != SCM_RIGHTS) {
+		call_or_exit(close(sock), "close (handoff)");
+		return -1;
+	}
+
+	int* received = (int *) CMSG_DATA(cmsg);
+	fds->assign(received, received + (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+
+	return sock;
+}
+
+void acknowledge_handoff(int sock) {
+	// If the old server has gone away in the meantime, there's no one left to tell
+	write_(sock, " ", 1);
+	call_or_exit(close(sock), "close (handoff)");
+}
+
+bool send_listeners(int sock, const std::vector<int>& fds) {
+	int count = fds.size();
+	if (count > MAX_LISTENERS) {
+		return false;
+	}
+
+	struct iovec iov = { &count, sizeof(count) };
+
+	char control[CMSG_SPACE(sizeof(int) * MAX_LISTENERS)];
+	struct msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+	memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * count);
+
+	ssize_t nwritten;
+	do {
+		nwritten = sendmsg(sock, &msg, 0);
+	} while (nwritten < 0 && errno == EINTR);
+
+	return nwritten == sizeof(count);
+}
+
+bool wait_for_acknowledgement(int sock) {
+	char ack;
+	ssize_t nread;
+
+	do {
+		nread = read(sock, &ack, 1);
+	} while (nread < 0 && errno == EINTR);
+
+	return nread == 1;
+}
+
+int listen_for_successor(const std::string& path) {
+	int sock;
+	call_or_exit(sock = socket(AF_UNIX, SOCK_STREAM, 0), "socket (handoff)");
+
+	struct sockaddr_un addr;
+	make_address(path, &addr);
+
+	unlink(path.c_str()); // Left behind by a server that didn't exit cleanly (if any)
+
+	call_or_exit(bind(sock, (struct sockaddr *) &addr, sizeof(addr)), "bind (handoff)");
+	call_or_exit(listen(sock, 1), "listen (handoff)");
+
+	return sock;
+}
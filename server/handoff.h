@@ -0,0 +1,37 @@
+#ifndef HANDOFF_H_
+#define HANDOFF_H_
+
+#include <string>
+#include <vector>
+
+// Zero-downtime restarts: a running server listens for a successor on a Unix socket
+// (-u option). A new server started with the same path connects to it, receives its
+// listening sockets (as SCM_RIGHTS ancillary data) and starts accepting clients on
+// them right away. Once its acceptors are running, it acknowledges the handoff, and
+// only then does the old server drain its transfers and exit (if the new server goes
+// away before that, the old one carries on). Connections that arrive in the meantime
+// wait in the shared sockets' queues, so none are lost.
+
+// Maximum number of listening sockets that can be handed over at once
+#define MAX_LISTENERS 256
+
+// Connects to the server listening on 'path' and receives its listening sockets into
+// 'fds'. Returns the connection to it, to acknowledge the handoff on, or -1 if there's
+// no server on 'path'.
+int receive_listeners(const std::string& path, std::vector<int>* fds);
+
+// Lets the old server connected to 'sock' know that the sockets it sent are being
+// accepted on, so it can drain. Closes 'sock'.
+void acknowledge_handoff(int sock);
+
+// Sends the sockets in 'fds' to the successor connected to 'sock'. Returns false on error.
+bool send_listeners(int sock, const std::vector<int>& fds);
+
+// Waits for the successor connected to 'sock' to acknowledge the handoff. Returns false
+// if it went away instead.
+bool wait_for_acknowledgement(int sock);
+
+// Creates the Unix socket that successors connect to, replacing any stale one at 'path'.
+int listen_for_successor(const std::string& path);
+
+#endif // HANDOFF_H_
@@ -0,0 +1,40 @@
+#ifndef PATH_ARENA_H_
+#define PATH_ARENA_H_
+
+#include <string>
+#include <vector>
+
+// Stores the paths found by a directory scan back to back in a single buffer, instead
+// of allocating a string for each one of them. The pointers returned by path() remain
+// valid until the next call to add(), so the arena should be filled before its paths
+// are handed out.
+
+class PathArena {
+  public:
+	void add(const std::string& path) {
+		offsets_.push_back(buf_.size());
+		buf_.append(path);
+		buf_ += '\0';
+	}
+
+	size_t size() { return offsets_.size(); }
+
+	// Removes all paths, but keeps the memory around for the next scan.
+	void clear() {
+		buf_.clear();
+		offsets_.clear();
+	}
+
+	// Returns the i-th path (null-terminated) and its length, respectively.
+	const char* path(size_t i) { return &buf_[offsets_[i]]; }
+	int path_size(size_t i) {
+		size_t end = i + 1 < offsets_.size() ? offsets_[i + 1] : buf_.size();
+		return end - offsets_[i] - 1;
+	}
+
+  private:
+	std::string buf_;
+	std::vector<size_t> offsets_;
+};
+
+#endif // PATH_ARENA_H_
@@ -1,9 +1,18 @@
 #include <string>
+#include <vector>
+#include <atomic>
+#include <cerrno>
 #include <cstdlib>
+#include <cstring>
+#include <climits>
+#include <cstdint>
+#include <fstream>
 #include <iostream>
 
 extern "C" {
+	#include <poll.h>
 	#include <netdb.h>
+	#include <signal.h>
 	#include <unistd.h>
 	#include <pthread.h>
 	#include <sys/wait.h>
@@ -14,13 +23,29 @@ extern "C" {
 }
 
 #include "threads.h"
+#include "handoff.h"
+#include "affinity.h"
 #include "cla_parser.h"
+#include "buffer_pool.h"
 #include "syscall_utils.h"
+#include "socket_tuning.h"
 
 // Global state used by the communication & worker threads
 SharedData data;
 
-static bool get_args(int argc, char *argv[], int* port, int* pool_size) {
+// Unix socket that successors connect to (-u option), if any
+static std::string control_path;
+
+// Set once the listening sockets have been handed over to a new server
+static std::atomic<bool> handed_off(false);
+
+// Set once the server starts draining (see start_draining). Listening sockets are only
+// closed after that, so they're handed over while holding 'drain_mutex'
+static bool draining = false;
+static pthread_mutex_t drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static bool get_args(int argc, char *argv[], int* port, int* pool_size, int* ngroups,
+                     std::string* config_file, std::string* control_path) {
 	ClaParser cla_parser(argc, argv);
 
 	if (!cla_parser.valid_args()) {
@@ -31,6 +56,9 @@ static bool get_args(int argc, char *argv[], int* port, int* pool_size) {
 	std::string pool_size_ = cla_parser.get_argument(std::string("-s"));
 	std::string queue_size_ = cla_parser.get_argument(std::string("-q"));
 	std::string block_size_ = cla_parser.get_argument(std::string("-b"));
+	std::string adaptive_ = cla_parser.get_argument(std::string("-a"));
+	std::string ngroups_ = cla_parser.get_argument(std::string("-g"));
+	std::string pin_mode_ = cla_parser.get_argument(std::string("-c"));
 
 	if (port_.empty() || pool_size_.empty() || queue_size_.empty() || block_size_.empty()) {
 		return false;
@@ -40,74 +68,236 @@ static bool get_args(int argc, char *argv[], int* port, int* pool_size) {
 	*pool_size = atoi(pool_size_.c_str());
 	data.task_capacity = atoi(queue_size_.c_str());
 	data.block_size = atoi(block_size_.c_str());
+	data.adaptive = adaptive_.empty() || atoi(adaptive_.c_str()) != 0; // Optional, on by default
+
+	if (data.block_size <= 0 || !parse_pin_mode(pin_mode_, &data.pin_mode)) {
+		return false;
+	}
+
+	// Optional: a single group by default, or one per NUMA node when pinning to nodes
+	if (!ngroups_.empty()) {
+		*ngroups = atoi(ngroups_.c_str());
+	} else {
+		*ngroups = data.pin_mode == PIN_NUMA ? numa_node_count() : 1;
+	}
+
+	// Every group needs at least one worker
+	if (*ngroups <= 0 || *ngroups > MAX_LISTENERS || *pool_size < *ngroups) {
+		return false;
+	}
+
+	// Optional: the file that's read on SIGHUP, and the socket used for handoffs
+	*config_file = cla_parser.get_argument(std::string("-f"));
+	*control_path = cla_parser.get_argument(std::string("-u"));
 
 	return true;
 }
 
-int main(int argc, char* argv[]) {
-	int port = 0;
-	int thread_pool_size = 0;
+// Creates a detached thread that runs on the CPUs in 'cpus'. Returns the status of
+// pthread_create(), which may fail if the system is out of resources.
+static int try_create_thread(void* (*start)(void*), void* arg, cpu_set_t* cpus) {
+	pthread_attr_t attr;
+	pthread_t thread_id;
 
-	// Process command line arguments
-	if (!get_args(argc, argv, &port, &thread_pool_size)) {
-		std::cerr << "Invalid program arguments\n";
-		exit(EXIT_FAILURE);
+	int status = pthread_attr_init(&attr);
+	pthread_call_or_exit(status, "pthread_attr_init (server)");
+
+	status = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_call_or_exit(status, "pthread_attr_setdetachstate (server)");
+
+	if (cpus != nullptr) {
+		status = pthread_attr_setaffinity_np(&attr, sizeof(*cpus), cpus);
+		pthread_call_or_exit(status, "pthread_attr_setaffinity_np (server)");
 	}
 
-	std::cerr << "\n"
-			  << "Server's parameters are:\n\n"
-	          << "port: " << port << "\n"
-	          << "thread_pool_size: " << thread_pool_size << "\n"
-	          << "queue_size: " << data.task_capacity << "\n"
-	          << "block_size: " << data.block_size << "\n\n";
+	int create_status = pthread_create(&thread_id, &attr, start, arg);
 
-	// Initialize mutexes and condition variables
-	// Note: we won't destroy these, since it's assumed that server will run 24/7
+	status = pthread_attr_destroy(&attr);
+	pthread_call_or_exit(status, "pthread_attr_destroy (server)");
 
-	pthread_mutex_init(&data.log_mutex, nullptr);
-	pthread_mutex_init(&data.queue_mutex, nullptr);
-	pthread_cond_init(&data.cond_nonfull, nullptr);
-	pthread_cond_init(&data.cond_nonempty, nullptr);
+	return create_status;
+}
 
-	// Configure sockets to start serving clients
-	int sock;
-	call_or_exit(sock = socket(AF_INET, SOCK_STREAM, 0), "socket (server)");
+// Same as try_create_thread(), but exits if the thread can't be created.
+static void create_thread(void* (*start)(void*), void* arg, cpu_set_t* cpus, const char* err) {
+	int status = try_create_thread(start, arg, cpus);
+	pthread_call_or_exit(status, err);
+}
 
-	struct sockaddr_in server;
+// Sets the number of worker threads of 'group', creating new ones if it grows. If it
+// shrinks, the extra workers exit as soon as they're done with their current task.
+static void resize_pool(WorkerGroup* group, int pool_size) {
+	int status = pthread_mutex_lock(&group->queue_mutex);
+	pthread_call_or_exit(status, "pthread_mutex_lock (queue_mutex)");
+
+	group->pool_size = pool_size;
+
+	// When pinning to cores each worker gets its own CPU, otherwise they may run
+	// anywhere in the group's CPUs (or node)
+	for (; group->nworkers < group->pool_size; group->nworkers++) {
+		cpu_set_t worker_cpus;
+		CPU_ZERO(&worker_cpus);
+		CPU_SET(nth_cpu(group->cpus, group->nworkers), &worker_cpus);
+
+		cpu_set_t* affinity = nullptr;
+		if (data.pin_mode == PIN_CORE) {
+			affinity = &worker_cpus;
+		} else if (data.pin_mode == PIN_NUMA) {
+			affinity = &group->cpus;
+		}
+
+		create_thread(worker_thread, group, affinity, "pthread_create (worker)");
+	}
 
-	server.sin_family = AF_INET;
-	server.sin_addr.s_addr = htonl(INADDR_ANY);
-	server.sin_port = htons(port);
+	// Wake up idle workers, so that the extra ones (if any) notice they should exit
+	status = pthread_cond_broadcast(&group->cond_nonempty);
+	pthread_call_or_exit(status, "pthread_cond_broadcast (cond_nonempty)");
 
-	call_or_exit(bind(sock, (struct sockaddr *) &server, sizeof(server)), "bind (server)");
-	call_or_exit(listen(sock, 10), "listen (server)"); // Backlog arbitrarily set to 10
+	status = pthread_mutex_unlock(&group->queue_mutex);
+	pthread_call_or_exit(status, "pthread_mutex_unlock (queue_mutex)");
+}
 
-	std::cerr << "Server was successfully initialized...\n"
-	          << "Listening for connections to port " << port << "\n\n";
+// Splits 'pool_size' worker threads among the groups.
+static void resize_pools(int pool_size) {
+	int ngroups = data.groups.size();
 
-	int status;
-	pthread_t thread_id;
+	for (int i = 0; i < ngroups; i++) {
+		resize_pool(data.groups[i], pool_size / ngroups + (i < pool_size % ngroups));
+	}
+}
+
+// Re-reads the options in 'config_file' (same syntax as the command line) and applies
+// the ones that can change while the server runs: -s, -q and -b.
+static void reload_config(const std::string& config_file) {
+	std::ifstream file(config_file.c_str());
+	std::vector<std::string> tokens(1, "dataServer");
+
+	for (std::string token; file >> token; ) {
+		tokens.push_back(token);
+	}
+
+	std::vector<char*> argv;
+	for (std::string& token : tokens) {
+		argv.push_back(&token[0]);
+	}
+
+	argv.push_back(nullptr);
+
+	ClaParser cla_parser(tokens.size(), argv.data());
 
-	// Create the worker thread pool
-	for (int i = 0; i < thread_pool_size; i++) {
-		status = pthread_create(&thread_id, nullptr, worker_thread, nullptr);
-		pthread_call_or_exit(status, "pthread_create (worker)");
+	int pool_size = atoi(cla_parser.get_argument(std::string("-s")).c_str());
+	int queue_size = atoi(cla_parser.get_argument(std::string("-q")).c_str());
+	int block_size = atoi(cla_parser.get_argument(std::string("-b")).c_str());
 
-		status = pthread_detach(thread_id);
-		pthread_call_or_exit(status, "pthread_detach (worker)");
+	int status = pthread_mutex_lock(&data.log_mutex);
+	pthread_call_or_exit(status, "pthread_mutex_lock (log_mutex)");
+
+	if (!file.eof() || !cla_parser.valid_args()) {
+		std::cerr << "[Thread " << pthread_self()
+		          << "]: Failed to reload configuration from " << config_file << "\n";
+	} else {
+		std::cerr << "[Thread " << pthread_self()
+		          << "]: Reloading configuration from " << config_file << "\n";
+	}
+
+	status = pthread_mutex_unlock(&data.log_mutex);
+	pthread_call_or_exit(status, "pthread_mutex_unlock (log_mutex)");
+
+	if (!file.eof() || !cla_parser.valid_args()) {
+		return;
+	}
+
+	// Options that are missing (or invalid) in the file are left unchanged
+	if (pool_size >= (int) data.groups.size()) {
+		resize_pools(pool_size);
 	}
 
+	if (queue_size > 0) {
+		data.task_capacity = queue_size;
+
+		// Wake up communication threads waiting for space, in case the queues grew
+		for (WorkerGroup* group : data.groups) {
+			status = pthread_mutex_lock(&group->queue_mutex);
+			pthread_call_or_exit(status, "pthread_mutex_lock (queue_mutex)");
+
+			status = pthread_cond_broadcast(&group->cond_nonfull);
+			pthread_call_or_exit(status, "pthread_cond_broadcast (cond_nonfull)");
+
+			status = pthread_mutex_unlock(&group->queue_mutex);
+			pthread_call_or_exit(status, "pthread_mutex_unlock (queue_mutex)");
+		}
+	}
+
+	// Note: blocks can't outgrow the buffers, which were sized at startup
+	if (block_size > 0) {
+		data.block_size = block_size;
+	}
+}
+
+struct Listener {
+	WorkerGroup* group;
+	int fd;
+};
+
+// Accepts the clients of a worker group, handing each one to a communication thread.
+static void* acceptor_thread(void* arg) {
+	Listener* listener = (Listener *) arg;
+	WorkerGroup* group = listener->group;
+	int listen_fd = listener->fd;
+	delete listener;
+
+	int status;
 	int new_sock;
 	socklen_t client_size;
 	struct sockaddr_in client;
 	char client_ip[INET_ADDRSTRLEN];
 
 	while (true) {
+		// Wait for a client, unless the server starts draining in the meantime
+		struct pollfd fds[2] = {
+			{ listen_fd, POLLIN, 0 },
+			{ data.drain_pipe[0], POLLIN, 0 }
+		};
+
+		if (poll(fds, 2, -1) < 0) {
+			call_or_exit(errno == EINTR ? 0 : -1, "poll (server)");
+			continue;
+		}
+
+		// Note: the socket may have been handed to another server, so it's only closed
+		// here (the other server still accepts clients through its own descriptor)
+		if (fds[1].revents != 0) {
+			call_or_exit(close(listen_fd), "close (server)");
+			break;
+		}
+
+		// A failed accept() only affects that client. If the process is out of file
+		// descriptors, back off for a bit, so that in-flight transfers can release some
 		client_size = sizeof(client);
-		call_or_exit(
-			new_sock = accept(sock, (struct sockaddr *) &client, &client_size),
-			"accept (server)"
-		);
+		new_sock = accept(listen_fd, (struct sockaddr *) &client, &client_size);
+		if (new_sock < 0) {
+			int accept_errno = errno;
+			if (accept_errno == EINTR || accept_errno == ECONNABORTED || accept_errno == EAGAIN) {
+				continue;
+			}
+
+			status = pthread_mutex_lock(&data.log_mutex);
+			pthread_call_or_exit(status, "pthread_mutex_lock (log_mutex)");
+
+			std::cerr << "[Thread " << pthread_self()
+			          << "]: accept (server): " << strerror(accept_errno) << "\n";
+
+			status = pthread_mutex_unlock(&data.log_mutex);
+			pthread_call_or_exit(status, "pthread_mutex_unlock (log_mutex)");
+
+			if (accept_errno == EMFILE || accept_errno == ENFILE) {
+				usleep(100 * 1000);
+			}
+
+			continue;
+		}
+
+		tune_socket(new_sock);
 
 		// This won't fail, since errors EAFNOSUPPORT and ENOSPC can't occur
 		inet_ntop(AF_INET, &client.sin_addr, client_ip, INET_ADDRSTRLEN); // Get client's ip
@@ -116,19 +306,357 @@ int main(int argc, char* argv[]) {
 		pthread_call_or_exit(status, "pthread_mutex_lock (log_mutex)");
 
 		std::cerr << "[Thread " << pthread_self()
-		          << "]: Accepted connection from " << client_ip << "\n";
+		          << "]: Accepted connection from " << client_ip
+		          << " (group " << group->id << ")\n";
+
+		status = pthread_mutex_unlock(&data.log_mutex);
+		pthread_call_or_exit(status, "pthread_mutex_unlock (log_mutex)");
+
+		// Let a communication thread handle the client. It inherits this thread's CPUs.
+		// If there's no room for another thread, the client is dropped.
+		Connection* conn = new Connection(new_sock, group, data.block_size);
+		status = try_create_thread(communication_thread, conn, nullptr);
+		if (status != 0) {
+			int create_status = status;
+
+			status = pthread_mutex_lock(&data.log_mutex);
+			pthread_call_or_exit(status, "pthread_mutex_lock (log_mutex)");
+
+			std::cerr << "[Thread " << pthread_self()
+			          << "]: pthread_create (communication thread): " << strerror(create_status)
+			          << ", dropping " << client_ip << "\n";
+
+			status = pthread_mutex_unlock(&data.log_mutex);
+			pthread_call_or_exit(status, "pthread_mutex_unlock (log_mutex)");
+
+			conn->release();
+		}
+	}
+
+	// Any client accepted so far has been counted in nconnections, so the server may
+	// exit once they're all done (see drain_thread)
+	status = pthread_mutex_lock(&data.conn_mutex);
+	pthread_call_or_exit(status, "pthread_mutex_lock (conn_mutex)");
+
+	if (--data.nacceptors == 0) {
+		status = pthread_cond_broadcast(&data.cond_idle);
+		pthread_call_or_exit(status, "pthread_cond_broadcast (cond_idle)");
+	}
+
+	status = pthread_mutex_unlock(&data.conn_mutex);
+	pthread_call_or_exit(status, "pthread_mutex_unlock (conn_mutex)");
+
+	return nullptr;
+}
+
+// Waits for the in-flight transfers to complete, and then terminates the server.
+static void* drain_thread(void*) {
+	int status = pthread_mutex_lock(&data.conn_mutex);
+	pthread_call_or_exit(status, "pthread_mutex_lock (conn_mutex)");
+
+	// An acceptor may be handing a client it has just accepted to a communication thread,
+	// so the acceptors must all have stopped before the server is considered idle
+	while (data.nacceptors > 0 || data.nconnections > 0) {
+		status = pthread_cond_wait(&data.cond_idle, &data.conn_mutex);
+		pthread_call_or_exit(status, "pthread_cond_wait (cond_idle, conn_mutex)");
+	}
+
+	status = pthread_mutex_unlock(&data.conn_mutex);
+	pthread_call_or_exit(status, "pthread_mutex_unlock (conn_mutex)");
+
+	// After a handoff, the control socket's path belongs to the new server
+	if (!control_path.empty() && !handed_off) {
+		unlink(control_path.c_str());
+	}
+
+	status = pthread_mutex_lock(&data.log_mutex);
+	pthread_call_or_exit(status, "pthread_mutex_lock (log_mutex)");
+
+	std::cerr << "[Thread " << pthread_self()
+	          << "]: All transfers have been completed, exiting...\n";
+
+	status = pthread_mutex_unlock(&data.log_mutex);
+	pthread_call_or_exit(status, "pthread_mutex_unlock (log_mutex)");
+
+	exit(EXIT_SUCCESS);
+}
+
+// Makes the server stop accepting clients, complete the in-flight transfers and then
+// exit. Returns false if it was already draining.
+static bool start_draining() {
+	int status = pthread_mutex_lock(&drain_mutex);
+	pthread_call_or_exit(status, "pthread_mutex_lock (drain_mutex)");
+
+	bool started = !draining;
+
+	if (started) {
+		draining = true;
+
+		status = pthread_mutex_lock(&data.log_mutex);
+		pthread_call_or_exit(status, "pthread_mutex_lock (log_mutex)");
+
+		std::cerr << "[Thread " << pthread_self()
+		          << "]: Draining: no new clients will be accepted\n";
 
 		status = pthread_mutex_unlock(&data.log_mutex);
 		pthread_call_or_exit(status, "pthread_mutex_unlock (log_mutex)");
 
-		int* arg = new int(new_sock); // This will be free'd from inside the new thread
+		call_or_exit(write_(data.drain_pipe[1], " ", 1), "write_ (server)");
+		create_thread(drain_thread, nullptr, nullptr, "pthread_create (drain thread)");
+	}
+
+	status = pthread_mutex_unlock(&drain_mutex);
+	pthread_call_or_exit(status, "pthread_mutex_unlock (drain_mutex)");
+
+	return started;
+}
+
+// Waits for a new server to connect to the control socket, hands it the listening
+// sockets and, once it acknowledges them, makes this server drain. If the new server
+// goes away before that, this one carries on (and waits for another one). The control
+// socket is closed as soon as the server starts draining, for whatever reason.
+static void* control_thread(void* arg) {
+	int control_sock = (int) (intptr_t) arg;
+
+	while (true) {
+		struct pollfd fds[2] = {
+			{ control_sock, POLLIN, 0 },
+			{ data.drain_pipe[0], POLLIN, 0 }
+		};
+
+		if (poll(fds, 2, -1) < 0) {
+			call_or_exit(errno == EINTR ? 0 : -1, "poll (handoff)");
+			continue;
+		}
+
+		if (fds[1].revents != 0) {
+			break;
+		}
+
+		int sock = accept(control_sock, nullptr, nullptr);
+		if (sock < 0) {
+			call_or_exit(errno == EINTR || errno == ECONNABORTED ? 0 : -1, "accept (handoff)");
+			continue;
+		}
+
+		std::vector<int> listen_fds;
+		for (WorkerGroup* group : data.groups) {
+			listen_fds.insert(listen_fds.end(), group->listen_fds.begin(), group->listen_fds.end());
+		}
+
+		// Once draining has started, the acceptors may have closed the sockets already
+		int status = pthread_mutex_lock(&drain_mutex);
+		pthread_call_or_exit(status, "pthread_mutex_lock (drain_mutex)");
+
+		bool sent = !draining && send_listeners(sock, listen_fds);
+
+		status = pthread_mutex_unlock(&drain_mutex);
+		pthread_call_or_exit(status, "pthread_mutex_unlock (drain_mutex)");
+
+		// The new server acknowledges the sockets once it's accepting clients on them
+		bool acked = sent && wait_for_acknowledgement(sock);
+
+		status = pthread_mutex_lock(&data.log_mutex);
+		pthread_call_or_exit(status, "pthread_mutex_lock (log_mutex)");
+
+		if (acked) {
+			std::cerr << "[Thread " << pthread_self()
+			          << "]: Handed the listening sockets over to a new server\n";
+		} else {
+			std::cerr << "[Thread " << pthread_self()
+			          << "]: Failed to hand the listening sockets over to a new server\n";
+		}
+
+		status = pthread_mutex_unlock(&data.log_mutex);
+		pthread_call_or_exit(status, "pthread_mutex_unlock (log_mutex)");
+
+		call_or_exit(close(sock), "close (handoff)");
+
+		if (acked) {
+			handed_off = true;
+			start_draining();
+			break;
+		}
+	}
+
+	call_or_exit(close(control_sock), "close (handoff)");
+
+	return nullptr;
+}
+
+// Creates a socket listening to 'port'. If 'shared', other sockets (one per group) may
+// listen to it as well. Otherwise, binding fails if the port is already in use, e.g. by
+// another server that was started by mistake.
+static int create_listener(int port, bool shared) {
+	int sock;
+	call_or_exit(sock = socket(AF_INET, SOCK_STREAM, 0), "socket (server)");
+
+	int on = 1;
+	if (shared) {
+		call_or_exit(
+			setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)),
+			"setsockopt SO_REUSEPORT (server)"
+		);
+	}
+
+	struct sockaddr_in server;
+
+	server.sin_family = AF_INET;
+	server.sin_addr.s_addr = htonl(INADDR_ANY);
+	server.sin_port = htons(port);
+
+	call_or_exit(bind(sock, (struct sockaddr *) &server, sizeof(server)), "bind (server)");
+	call_or_exit(listen(sock, 10), "listen (server)"); // Backlog arbitrarily set to 10
+
+	return sock;
+}
+
+int main(int argc, char* argv[]) {
+	int port = 0;
+	int thread_pool_size = 0;
+	int ngroups = 1;
+	std::string config_file;
+
+	// Process command line arguments
+	if (!get_args(argc, argv, &port, &thread_pool_size, &ngroups, &config_file, &control_path)) {
+		std::cerr << "Invalid program arguments\n";
+		exit(EXIT_FAILURE);
+	}
+
+	const char* pin_modes[] = { "none", "core", "numa" };
 
-		// Let a communication thread handle the client (pass the socket fd to it)
-		status = pthread_create(&thread_id, nullptr, communication_thread, arg);
-		pthread_call_or_exit(status, "pthread_create (communication thread)");
+	std::cerr << "\n"
+			  << "Server's parameters are:\n\n"
+	          << "port: " << port << "\n"
+	          << "thread_pool_size: " << thread_pool_size << "\n"
+	          << "queue_size: " << data.task_capacity << "\n"
+	          << "block_size: " << data.block_size << "\n"
+	          << "adaptive_block_size: " << (data.adaptive ? "on" : "off") << "\n"
+	          << "worker_groups: " << ngroups << "\n"
+	          << "cpu_pinning: " << pin_modes[data.pin_mode] << "\n\n";
+
+	// Buffers must fit the largest block, as well as a file's header (its name and size,
+	// or the index of the file it duplicates)
+	size_t buffer_size = 4 + data.block_size;
+	if (data.adaptive && data.block_size < MAX_BLOCK_SIZE) {
+		buffer_size = 4 + MAX_BLOCK_SIZE;
+	}
+
+	if (buffer_size < 16 + PATH_MAX) {
+		buffer_size = 16 + PATH_MAX;
+	}
+
+	BufferPool::set_buffer_size(buffer_size);
+
+	// Signals are handled synchronously by the main thread, so they're blocked in all
+	// threads (new threads inherit the signal mask of the thread that creates them)
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGHUP);
+
+	int status = pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+	pthread_call_or_exit(status, "pthread_sigmask (server)");
+
+	// A client that goes away mid-transfer must only end its own connection: writing to
+	// its socket then fails with EPIPE, instead of killing the server with SIGPIPE
+	signal(SIGPIPE, SIG_IGN);
+
+	// Initialize mutexes and condition variables
+	// Note: we won't destroy these, since the server only exits through exit()
+
+	pthread_mutex_init(&data.log_mutex, nullptr);
+	pthread_mutex_init(&data.conn_mutex, nullptr);
+	pthread_cond_init(&data.cond_idle, nullptr);
 
-		status = pthread_detach(thread_id);
-		pthread_call_or_exit(status, "pthread_detach (communication thread)");
+	call_or_exit(pipe(data.drain_pipe), "pipe (server)");
+
+	// If another server is running, take over its listening sockets instead of binding
+	// new ones (the received sockets are dealt to the groups round robin)
+	std::vector<int> inherited;
+	int handoff_sock = control_path.empty() ? -1 : receive_listeners(control_path, &inherited);
+
+	if (handoff_sock >= 0) {
+		std::cerr << "Took over " << inherited.size() << " listening sockets from "
+		          << "the server at " << control_path << "\n";
+	}
+
+	std::vector<cpu_set_t> cpus = partition_cpus(data.pin_mode, ngroups);
+
+	for (int i = 0; i < ngroups; i++) {
+		WorkerGroup* group = new WorkerGroup();
+
+		group->id = i;
+		group->cpus = cpus[i];
+		group->pool_size = 0;
+		group->nworkers = 0;
+
+		pthread_mutex_init(&group->queue_mutex, nullptr);
+		pthread_cond_init(&group->cond_nonfull, nullptr);
+		pthread_cond_init(&group->cond_nonempty, nullptr);
+
+		data.groups.push_back(group);
+	}
+
+	for (size_t i = 0; i < inherited.size(); i++) {
+		data.groups[i % ngroups]->listen_fds.push_back(inherited[i]);
+	}
+
+	// Configure sockets to start serving clients (all groups listen to the same port, so
+	// the port is only shared if there's more than one group)
+	for (WorkerGroup* group : data.groups) {
+		if (group->listen_fds.empty()) {
+			group->listen_fds.push_back(create_listener(port, ngroups > 1));
+		}
+	}
+
+	std::cerr << "Server was successfully initialized...\n"
+	          << "Listening for connections to port " << port << "\n\n";
+
+	// Create the worker threads and the acceptor threads, for each group
+	resize_pools(thread_pool_size);
+
+	for (WorkerGroup* group : data.groups) {
+		cpu_set_t* affinity = data.pin_mode == PIN_NONE ? nullptr : &group->cpus;
+
+		for (int fd : group->listen_fds) {
+			Listener* listener = new Listener{ group, fd }; // Free'd by the acceptor thread
+			data.nacceptors++; // Acceptors only count themselves out once draining starts
+			create_thread(acceptor_thread, listener, affinity, "pthread_create (acceptor)");
+		}
+	}
+
+	// The old server (if any) can drain now
+	if (handoff_sock >= 0) {
+		acknowledge_handoff(handoff_sock);
+	}
+
+	if (!control_path.empty()) {
+		void* arg = (void *) (intptr_t) listen_for_successor(control_path);
+		create_thread(control_thread, arg, nullptr, "pthread_create (control thread)");
+	}
+
+	// SIGHUP reloads the configuration, SIGINT and SIGTERM make the server drain: stop
+	// accepting clients, complete the in-flight transfers and then exit. If one of them
+	// arrives again while draining, the server exits right away.
+	while (true) {
+		int signo;
+		status = sigwait(&signals, &signo);
+		pthread_call_or_exit(status, "sigwait (server)");
+
+		if (signo == SIGHUP) {
+			if (!config_file.empty()) {
+				reload_config(config_file);
+			}
+
+			continue;
+		}
+
+		if (!start_draining()) {
+			std::cerr << "[Thread " << pthread_self() << "]: Terminating forcefully\n";
+			exit(EXIT_FAILURE);
+		}
 	}
 
 	return 0;
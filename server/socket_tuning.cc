@@ -0,0 +1,119 @@
+#include "socket_tuning.h"
+
+#include <fstream>
+
+// Note: the kernel's header is used for TCP_INFO, since glibc's struct tcp_info lacks
+// tcpi_delivery_rate
+extern "C" {
+	#include <sys/types.h>
+	#include <sys/time.h>
+	#include <sys/socket.h>
+	#include <netinet/in.h>
+	#include <linux/tcp.h>
+}
+
+// Upper limit for the send buffer size we request (the kernel caps it at wmem_max)
+#define MAX_SNDBUF (16 << 20)
+
+// Unsent data threshold, past which the socket isn't reported as writable
+#define NOTSENT_LOWAT (128 << 10)
+
+// Seconds a write to a client may go without any progress before it fails (EAGAIN)
+#define SEND_TIMEOUT 30
+
+// Failing to set any of these options only costs performance (or, for the timeout, lets
+// a stalled client keep its worker), so errors are ignored.
+
+void tune_socket(int fd) {
+	int on = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	int lowat = NOTSENT_LOWAT;
+	setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+
+	struct timeval timeout = { SEND_TIMEOUT, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+void set_cork(int fd, bool on) {
+	int value = on ? 1 : 0;
+	setsockopt(fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+}
+
+// Returns net.core.wmem_max, the largest send buffer that SO_SNDBUF can ask for (or 0 if
+// it can't be read). It's read once, the first time it's needed.
+static int wmem_max() {
+	static int value = [] {
+		int result = 0;
+		std::ifstream file("/proc/sys/net/core/wmem_max");
+		file >> result;
+		return result;
+	}();
+
+	return value;
+}
+
+void resize_send_buffer(int fd) {
+	struct tcp_info info;
+	socklen_t info_size = sizeof(info);
+
+	if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &info_size) < 0
+	    || info.tcpi_rtt == 0 || info.tcpi_delivery_rate == 0) {
+		return;
+	}
+
+	// Two bandwidth-delay products, so that the pipe stays full while we refill the buffer
+	double wanted = 2 * (double) info.tcpi_delivery_rate * (info.tcpi_rtt / 1e6);
+	if (wanted > MAX_SNDBUF) {
+		wanted = MAX_SNDBUF;
+	}
+
+	if (wanted > wmem_max()) {
+		wanted = wmem_max();
+	}
+
+	// Note: the kernel reports (and allocates) twice the size that was set, for its
+	// bookkeeping overhead
+	int current;
+	socklen_t current_size = sizeof(current);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &current, &current_size) < 0) {
+		return;
+	}
+
+	if (2 * wanted > current) {
+		int sndbuf = (int) wanted;
+		setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+	}
+}
+
+BlockSizeController::BlockSizeController(int step)
+	: step_(step), block_size_(step), avg_rate_(0) {
+	max_block_size_ = step > MAX_BLOCK_SIZE ? step : MAX_BLOCK_SIZE;
+
+	if (block_size_ < MIN_BLOCK_SIZE) {
+		block_size_ = MIN_BLOCK_SIZE;
+	}
+}
+
+void BlockSizeController::update(int nbytes, double seconds) {
+	if (seconds <= 0) {
+		return;
+	}
+
+	double rate = nbytes / seconds;
+
+	if (rate >= avg_rate_ / 2) {
+		block_size_ += step_; // Additive increase
+		if (block_size_ > max_block_size_) {
+			block_size_ = max_block_size_;
+		}
+	} else {
+		block_size_ /= 2; // Multiplicative decrease
+		if (block_size_ < MIN_BLOCK_SIZE) {
+			block_size_ = MIN_BLOCK_SIZE;
+		}
+	}
+
+	avg_rate_ = avg_rate_ == 0 ? rate : 0.75 * avg_rate_ + 0.25 * rate;
+}
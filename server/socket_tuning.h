@@ -0,0 +1,54 @@
+#ifndef SOCKET_TUNING_H_
+#define SOCKET_TUNING_H_
+
+// Bounds for the adaptive block size. The lower bound keeps the per-block header
+// overhead negligible, while the upper bound keeps latency reasonable for clients
+// that share the same worker pool.
+
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE (1 << 20)
+
+// Applies the options every accepted client socket should have: TCP_NODELAY (blocks
+// are written whole, so Nagle only delays them), TCP_NOTSENT_LOWAT (bounds the
+// amount of unsent data that can sit in the kernel behind a large block) and a send
+// timeout, so that a client that stops reading can't hold a worker (and its socket's
+// lock) forever: its writes fail instead, and only its connection is broken.
+
+void tune_socket(int fd);
+
+// Sets (or clears) TCP_CORK on 'fd'. While corked, partial frames are held back so
+// that a file's header and its first block leave the host in the same segment.
+
+void set_cork(int fd, bool on);
+
+// Grows the socket's send buffer so that it can hold the bandwidth-delay product, as
+// estimated from the delivery rate and smoothed RTT reported by TCP_INFO. Setting the
+// size turns off the kernel's autotuning for the socket and is capped at wmem_max, so
+// it's only done if that makes the buffer larger than autotuning has made it so far.
+// It costs two getsockopt() calls, so it's meant to be called once per file.
+
+void resize_send_buffer(int fd);
+
+// Block size controller used by the worker threads (one per client socket). The block
+// size starts at 'step' bytes and then follows an AIMD scheme: it grows by 'step' bytes
+// while the measured throughput keeps up with its moving average, and it's halved when
+// it collapses (i.e. the socket's send buffer filled up and we blocked). Callers clamp
+// it to the bytes left in the file, so small files still go out in a single block.
+
+class BlockSizeController {
+  public:
+	explicit BlockSizeController(int step);
+
+	int block_size() { return block_size_; }
+
+	// Reports that 'nbytes' were sent in 'seconds', and adjusts the block size to it.
+	void update(int nbytes, double seconds);
+
+  private:
+	int step_;
+	int max_block_size_;
+	int block_size_;
+	double avg_rate_; // Exponentially weighted moving average of the throughput
+};
+
+#endif // SOCKET_TUNING_H_
@@ -1,40 +1,139 @@
 #ifndef THREADS_H_
 #define THREADS_H_
 
-#include <map>
 #include <queue>
+#include <atomic>
+#include <cstdint>
 #include <string>
+#include <vector>
+#include <unordered_map>
 
 extern "C" {
+	#include <sched.h>
 	#include <pthread.h>
+	#include <sys/stat.h>
 }
 
+#include "affinity.h"
+#include "path_arena.h"
+#include "socket_tuning.h"
+
 // Client will request files in a directory relative to this path.
 #define STARTDIR "./test_files/"
 
-struct Task {
+struct WorkerGroup;
+
+// A file that was sent in full to a client that asked for duplicates to be left out.
+// Later files with the same contents are sent as references to it, as long as it's
+// unchanged (same inode, size and modification time as when it was sent).
+
+struct SentFile {
+	int id; // Index of the file among all the files sent to the client
+	std::string path;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	bool hashed; // Whether 'hash' holds its content hash (computed lazily)
+	uint64_t hash;
+};
+
+// State of a client's connection. It's shared by the communication thread serving the
+// client and every task created for it, each of which holds a reference to it, so the
+// socket is closed (and the state freed) only after the last of them is done with it.
+
+struct Connection {
 	int fd; // Socket file descriptor
-	std::string name; // Name of file to be processed
+	WorkerGroup* group; // Group whose threads serve the client
+	bool dedup; // Set if the client asked for duplicates, before any task is created
+
+	pthread_mutex_t send_mutex; // Protects writing to the socket and the fields below
+	bool broken; // Set once writing to the socket fails, after which files are skipped
+	long long bytes_sent; // Number of bytes written to the socket so far
+	int files_sent; // Number of files transferred so far
+	int pending; // Number of files of the current request that haven't been sent yet
+	int next_file_id; // Index of the next file to be sent (its header, at least)
+	std::unordered_multimap<off_t, SentFile> sent_files; // By file size (dedup only)
+	pthread_cond_t cond_sent; // Signalled when the current request's files are all sent
+	BlockSizeController controller; // Block size for this socket, kept across files
 
-	Task(int _fd, std::string _name) : fd(_fd), name(_name) { }
+	PathArena paths; // Paths of the current request's files, set before any task is created
+
+	Connection(int _fd, WorkerGroup* _group, int block_size);
+	~Connection();
+
+	// Adds and drops a reference, respectively. The connection starts with a single
+	// reference, and it's deleted as soon as the last one is dropped.
+	void acquire() { refs_.fetch_add(1, std::memory_order_relaxed); }
+	void release() {
+		if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+			delete this;
+		}
+	}
+
+	Connection(const Connection&) = delete;
+	Connection& operator=(const Connection&) = delete;
+
+  private:
+	std::atomic<int> refs_;
 };
 
-struct SharedData {
-	int block_size; // Files are transmitted in blocks of this size
-	int task_capacity; // Maximum number of available tasks in queue
+// Tasks are trivially copyable: the file name lives in the connection's path arena,
+// and the reference to the connection is counted explicitly (see Connection::acquire).
+
+struct Task {
+	Connection* conn; // Connection of the client requesting the file
+	const char* name; // Name of file to be processed
+	int name_size;
+
+	Task(Connection* _conn, const char* _name, int _name_size)
+		: conn(_conn), name(_name), name_size(_name_size) { }
+};
+
+// The server's threads are split in groups (-g option), each with its own listening
+// socket (they share the port through SO_REUSEPORT, so the kernel spreads clients among
+// them), task queue and workers. A client is served only by the threads of the group
+// that accepted it, which may all be pinned to the same CPUs (see affinity.h).
+
+struct WorkerGroup {
+	int id;
+	std::vector<int> listen_fds; // Listening sockets of the group (usually just one)
+	cpu_set_t cpus; // CPUs the group's threads run on
+
+	int pool_size; // Number of worker threads the group should have
+	int nworkers; // Number of worker threads the group has (more, while shrinking)
+
 	std::queue<Task> tasks;
 
-	pthread_mutex_t log_mutex; // Protects writing to std::cerr (for logging)
-	pthread_mutex_t queue_mutex; // Protects access to the task queue
+	pthread_mutex_t queue_mutex; // Protects access to the task queue and the counts above
 	pthread_cond_t cond_nonfull; // Condition needed for communication thread
 	pthread_cond_t cond_nonempty; // Condition needed for worker thread
+};
+
+// Note: block_size and task_capacity may change while the server runs (on SIGHUP).
+
+struct SharedData {
+	std::atomic<int> block_size; // Files are transmitted in blocks of this (initial) size
+	bool adaptive; // Whether the block size is adjusted based on the send throughput
+	std::atomic<int> task_capacity; // Maximum number of available tasks in each group's queue
+
+	PinMode pin_mode; // How the threads are pinned to CPUs
+	std::vector<WorkerGroup*> groups;
+
+	pthread_mutex_t log_mutex; // Protects writing to std::cerr (for logging)
+
+	int nconnections; // Number of open client connections
+	int nacceptors; // Number of acceptor threads that haven't stopped accepting yet
+	pthread_mutex_t conn_mutex; // Protects nconnections and nacceptors
+	pthread_cond_t cond_idle; // Signalled when either count drops to 0
 
-	std::map<int, pthread_mutex_t*> fd_to_mutex; // Protects writing to a socket fd
+	int drain_pipe[2]; // Its read end becomes readable once the server starts draining
 };
 
 extern SharedData data;
 
-// Starting points for worker and communication threads, respectively.
+// Starting points for worker and communication threads, respectively. The former
+// takes the WorkerGroup it belongs to, the latter takes the client's Connection.
 void* worker_thread(void* arg);
 void* communication_thread(void* arg);
 
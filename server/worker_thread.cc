@@ -1,25 +1,329 @@
 #include "threads.h"
 
-#include <map>
-#include <queue>
+#include <ctime>
+#include <cerrno>
 #include <string>
+#include <vector>
+#include <cstring>
 #include <iostream>
 
 extern "C" {
 	#include <fcntl.h>
+	#include <unistd.h>
 	#include <pthread.h>
 	#include <sys/stat.h>
 	#include <sys/types.h>
 }
 
-#include "reader.h"
+#include "protocol.h"
+#include "buffer_pool.h"
+#include "content_cache.h"
 #include "syscall_utils.h"
+#include "socket_tuning.h"
 
-static void process_task(Task& task) {
-	int file_fd;
-	call_or_exit(file_fd = open(task.name.c_str(), O_RDONLY), "open file (worker thread)");
+// Encodes 'value' in 4 bytes (least significant byte comes first) starting at 'buf'.
+static void put_int(char* buf, int value) {
+	for (int i = 0; i < 4; i++) {
+		buf[i] = (char) (value >> (i * 8)) & 0xFF;
+	}
+}
+
+// Same as put_int(), for the 8-byte fields (file and hole sizes).
+static void put_long(char* buf, long long value) {
+	for (int i = 0; i < 8; i++) {
+		buf[i] = (char) (value >> (i * 8)) & 0xFF;
+	}
+}
+
+static double elapsed_seconds(struct timespec& start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+// Outcomes of sending a file to a client
+enum SendResult { SENT, READ_FAILED, SOCKET_FAILED };
+
+// Returns the offset of the first data (i.e. not a hole) of the file that 'file_fd'
+// refers to at or after 'offset', and sets '*data_end' to where that data ends. Both
+// are capped at 'size'. If the file system can't tell holes apart, it's all data.
+// Returns -1 if the file has been truncated below 'size' since it was opened.
+static long long find_data(int file_fd, long long offset, long long size, long long* data_end) {
+	*data_end = size;
+
+	off_t data_start = lseek(file_fd, offset, SEEK_DATA);
+	if (data_start < 0 && errno != ENXIO) {
+		return offset;
+	}
+
+	// ENXIO means there's no data past 'offset': the rest of the file is a hole, unless
+	// the file has shrunk, in which case the client must not get zeros in its place
+	if (data_start < 0) {
+		struct stat st_buf;
+		if (fstat(file_fd, &st_buf) < 0 || st_buf.st_size < size) {
+			errno = EIO;
+			return -1;
+		}
+
+		return size;
+	}
+
+	if (data_start >= size) {
+		return size;
+	}
+
+	off_t hole_start = lseek(file_fd, data_start, SEEK_HOLE);
+	if (hole_start > data_start && hole_start < size) {
+		*data_end = hole_start;
+	}
+
+	// Both calls move the file offset, so it's set back to where the data starts
+	lseek(file_fd, data_start, SEEK_SET);
+
+	return data_start;
+}
+
+// Tells the client to discard the file being sent, since reading it failed with errno
+// (which is preserved). Returns READ_FAILED, or SOCKET_FAILED if writing fails.
+static SendResult send_block_error(Connection& conn, char* buf, long long* bytes_sent) {
+	int read_error = errno;
+
+	put_int(buf, BLOCK_ERROR);
+	if (write_(conn.fd, buf, 4) < 0) {
+		return SOCKET_FAILED;
+	}
+
+	set_cork(conn.fd, false);
+	*bytes_sent += 4;
+
+	errno = read_error;
+	return READ_FAILED;
+}
+
+// Sends the header (already in 'buf') and the contents of the file that 'file_fd' refers
+// to, which is 'size' bytes long, to the client. If the file is 'sparse', its holes are
+// sent as their size alone. If reading the file fails midway, the client gets an error
+// frame in place of the next block, so that it can skip the file.
+// Must be called with the connection's send_mutex held.
+static SendResult send_file(Connection& conn, char* buf, int header_size, int file_fd,
+                            long long size, bool sparse, long long* bytes_sent) {
+	long long capacity = BufferPool::buffer_size() - 4;
+
+	// Hold back the header until the first block is written, so they're sent together
+	set_cork(conn.fd, true);
+
+	if (write_(conn.fd, buf, header_size) < 0) {
+		return SOCKET_FAILED;
+	}
 
-	Reader reader(file_fd);
+	*bytes_sent = header_size;
+
+	// Send file data as messages of the form: <payload size> <payload> (in blocks), and
+	// holes as: <hole marker> <hole size> (8 bytes). The data is sent one extent at a time, and the
+	// next one is looked up when the current one is done (files that aren't sparse are a
+	// single extent, so they don't need any lookups)
+	// Note: we stop at the size announced in the header, even if the file has grown since
+	long long offset = 0;
+	long long data_end = sparse ? 0 : size;
+
+	for (bool first = true; offset < size; ) {
+		if (offset == data_end) {
+			long long data_start = find_data(file_fd, offset, size, &data_end);
+			if (data_start < 0) {
+				return send_block_error(conn, buf, bytes_sent);
+			}
+
+			if (offset < data_start) {
+				put_int(buf, HOLE_MARKER);
+				put_long(buf + 4, data_start - offset);
+
+				if (write_(conn.fd, buf, 12) < 0) {
+					return SOCKET_FAILED;
+				}
+
+				*bytes_sent += 12;
+				offset = data_start;
+			}
+
+			continue;
+		}
+
+		// Unless it's fixed (-a 0), the block size is adjusted after every block based on
+		// the throughput we get out of the socket, and it carries over to the next file
+		long long block_size = data.adaptive ? conn.controller.block_size() : data.block_size.load();
+		if (block_size > data_end - offset) {
+			block_size = data_end - offset;
+		}
+
+		if (block_size > capacity) {
+			block_size = capacity;
+		}
+
+		// The file may have been truncated since it was opened, which is an error too
+		int nread = read_(file_fd, buf + 4, block_size);
+		if (nread <= 0) {
+			if (nread == 0) {
+				errno = EIO;
+			}
+
+			return send_block_error(conn, buf, bytes_sent);
+		}
+
+		offset += nread;
+		put_int(buf, nread);
+
+		struct timespec start;
+		if (data.adaptive) {
+			clock_gettime(CLOCK_MONOTONIC, &start);
+		}
+
+		if (write_(conn.fd, buf, 4 + nread) < 0) {
+			return SOCKET_FAILED;
+		}
+
+		*bytes_sent += 4 + nread;
+
+		if (first) {
+			set_cork(conn.fd, false);
+			first = false;
+		}
+
+		if (data.adaptive) {
+			conn.controller.update(4 + nread, elapsed_seconds(start));
+		}
+	}
+
+	// Empty files have no blocks, so the header might still be held back
+	set_cork(conn.fd, false);
+
+	// By now the connection has carried enough data for its delivery rate to be known
+	resize_send_buffer(conn.fd);
+
+	return SENT;
+}
+
+// Opens the file that was sent as 'sent'. The client has the contents it had back then,
+// so it must not have changed since. Returns the file descriptor, or -1 (also if it did).
+static int open_sent_file(const SentFile& sent) {
+	int fd = open(sent.path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+
+	struct stat st;
+	bool unchanged = fstat(fd, &st) == 0
+	                 && st.st_dev == sent.dev && st.st_ino == sent.ino && st.st_size == sent.size
+	                 && st.st_mtim.tv_sec == sent.mtime.tv_sec
+	                 && st.st_mtim.tv_nsec == sent.mtime.tv_nsec;
+
+	if (!unchanged) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+// Sets '*hash' to the content hash of 'sent'. Only a file that was never hashed (or that
+// fell out of the cache) is read, and its hash is then kept with it. Returns false if
+// the file can't be read or has changed.
+static bool sent_file_hash(Connection& conn, const SentFile& sent, char* buf, uint64_t* hash) {
+	if (sent.hashed) {
+		*hash = sent.hash;
+		return true;
+	}
+
+	if (!ContentCache::lookup(sent.dev, sent.ino, sent.size, sent.mtime, hash)) {
+		int fd = open_sent_file(sent);
+		if (fd < 0) {
+			return false;
+		}
+
+		struct stat st;
+		bool hashed = fstat(fd, &st) == 0
+		              && ContentCache::hash(fd, st, buf, BufferPool::buffer_size(), hash);
+		close(fd);
+
+		if (!hashed) {
+			return false;
+		}
+	}
+
+	int status = pthread_mutex_lock(&conn.send_mutex);
+	pthread_call_or_exit(status, "pthread_mutex_lock (worker thread: socket fd)");
+
+	auto range = conn.sent_files.equal_range(sent.size);
+	for (auto it = range.first; it != range.second; ++it) {
+		if (it->second.id == sent.id) {
+			it->second.hashed = true;
+			it->second.hash = *hash;
+		}
+	}
+
+	status = pthread_mutex_unlock(&conn.send_mutex);
+	pthread_call_or_exit(status, "pthread_mutex_unlock (worker thread: socket fd)");
+
+	return true;
+}
+
+// Returns the index of a file already sent to the client that has the same contents as
+// the file that 'file_fd' (described by 'st') refers to, or -1 if there's none. Only
+// files of the same size are candidates, so a file is only hashed if there's any. Their
+// hashes are kept, and only files with equal hashes are opened and compared byte by
+// byte, through 'buf'.
+static int find_duplicate(Connection& conn, int file_fd, const struct stat& st, char* buf) {
+	int status = pthread_mutex_lock(&conn.send_mutex);
+	pthread_call_or_exit(status, "pthread_mutex_lock (worker thread: socket fd)");
+
+	std::vector<SentFile> candidates;
+	auto range = conn.sent_files.equal_range(st.st_size);
+	for (auto it = range.first; it != range.second; ++it) {
+		candidates.push_back(it->second);
+	}
+
+	status = pthread_mutex_unlock(&conn.send_mutex);
+	pthread_call_or_exit(status, "pthread_mutex_unlock (worker thread: socket fd)");
+
+	// The same (unchanged) inode, e.g. a hard link, needs no reading at all
+	for (SentFile& sent : candidates) {
+		if (sent.dev == st.st_dev && sent.ino == st.st_ino
+		    && sent.mtime.tv_sec == st.st_mtim.tv_sec && sent.mtime.tv_nsec == st.st_mtim.tv_nsec) {
+			return sent.id;
+		}
+	}
+
+	size_t bufsize = BufferPool::buffer_size();
+
+	uint64_t hash;
+	if (candidates.empty() || !ContentCache::hash(file_fd, st, buf, bufsize, &hash)) {
+		return -1;
+	}
+
+	for (SentFile& sent : candidates) {
+		uint64_t sent_hash;
+		if (!sent_file_hash(conn, sent, buf, &sent_hash) || sent_hash != hash) {
+			continue;
+		}
+
+		int sent_fd = open_sent_file(sent);
+		if (sent_fd < 0) {
+			continue;
+		}
+
+		bool same = ContentCache::same_contents(file_fd, sent_fd, st.st_size, buf, bufsize);
+		close(sent_fd);
+
+		if (same) {
+			return sent.id;
+		}
+	}
+
+	return -1;
+}
+
+static void process_task(Task& task) {
+	Connection& conn = *task.conn;
 
 	int status = pthread_mutex_lock(&data.log_mutex);
 	pthread_call_or_exit(status, "pthread_mutex_lock (log_mutex");
@@ -30,102 +334,164 @@ static void process_task(Task& task) {
 	status = pthread_mutex_unlock(&data.log_mutex);
 	pthread_call_or_exit(status, "pthread_mutex_unlock (log_mutex");
 
+	// The file may have been deleted (or made unreadable) since the directory was scanned.
+	// In that case, the client gets an error frame in place of the file's size
 	struct stat st_buf;
-	call_or_exit(stat(task.name.c_str(), &st_buf), "stat (worker thread)");
+	int file_fd = open(task.name, O_RDONLY);
+	int error = 0;
 
-	std::string msg;
-	int filename_size = task.name.size();
+	if (file_fd < 0 || fstat(file_fd, &st_buf) < 0) {
+		error = errno;
+		st_buf.st_size = 0;
+	}
 
-	// Create message: <file name size> <file name> <file size> (4 + n bytes + 4 bytes)
-	for (int i = 0; i < 4; i++) {
-		msg += (char) (filename_size >> (i * 8)) & 0xFF;
+	// The buffer holds the file's header first, and then each one of its blocks
+	char* buf = BufferPool::acquire();
+
+	// If the client asked for it, files with the same contents as one it has already
+	// received are sent as a reference to that one, instead of in full
+	bool dedup = conn.dedup && error == 0 && st_buf.st_size > 0;
+	int duplicate_of = dedup ? find_duplicate(conn, file_fd, st_buf, buf) : -1;
+
+	// Create message: <file name size> <file name> <file size> (4 + n bytes + 8 bytes),
+	// where a duplicate's size is replaced by a marker and the original's index
+	int header_size = 4 + task.name_size + 8;
+	put_int(buf, task.name_size);
+	memcpy(buf + 4, task.name, task.name_size);
+
+	if (error != 0) {
+		put_long(buf + 4 + task.name_size, FILE_ERROR);
+	} else if (duplicate_of >= 0) {
+		put_long(buf + 4 + task.name_size, FILE_DUPLICATE);
+		put_int(buf + header_size, duplicate_of);
+		header_size += 4;
+	} else {
+		put_long(buf + 4 + task.name_size, st_buf.st_size);
 	}
 
-	msg += task.name;
+	long long size = duplicate_of >= 0 ? 0 : st_buf.st_size;
 
-	for (int i = 0, size = st_buf.st_size; i < 4; i++) {
-		msg += (char) (size >> (i * 8)) & 0xFF;
-	}
+	// Only files with fewer blocks allocated than their size may have holes
+	bool sparse = error == 0 && (long long) st_buf.st_blocks * 512 < st_buf.st_size;
 
 	// The following lock is required so that only one file is transmitted at a time
-	status = pthread_mutex_lock(data.fd_to_mutex[task.fd]);
+	status = pthread_mutex_lock(&conn.send_mutex);
 	pthread_call_or_exit(status, "pthread_mutex_lock (worker thread: socket fd)");
 
-	call_or_exit(write_(task.fd, msg.c_str(), msg.size()), "write_ (worker thread)");
-
-	// Send file data as messages of the form: <payload size> <payload> (in blocks)
-	for (int ch, nread; true; ) {
-		msg = "";
-		nread = 0;
-
-		while (nread < data.block_size) {
-			ch = reader.next();
-			if (reader.eof()) {
-				break;
-			}
-
-			nread++;
-			msg += (char) ch;
+	// Once writing to the socket has failed (e.g. the client disconnected), the rest of
+	// the client's files are skipped, but the other clients aren't affected
+	SendResult result = SOCKET_FAILED;
+	long long bytes_sent = 0;
+
+	if (!conn.broken) {
+		int file_id = conn.next_file_id++;
+		result = send_file(conn, buf, header_size, file_fd, size, sparse, &bytes_sent);
+
+		if (result == SOCKET_FAILED) {
+			error = errno;
+			conn.broken = true;
+		} else if (result == READ_FAILED) {
+			error = errno;
+		} else if (dedup && duplicate_of < 0) {
+			// Its hash is already cached if it was computed to look for a duplicate
+			SentFile sent = { file_id, task.name, st_buf.st_dev, st_buf.st_ino, st_buf.st_size,
+			                  st_buf.st_mtim, false, 0 };
+			sent.hashed = ContentCache::lookup(sent.dev, sent.ino, sent.size, sent.mtime, &sent.hash);
+			conn.sent_files.insert(std::make_pair(st_buf.st_size, sent));
 		}
+	}
 
-		if (nread == 0) {
-			break;
-		}
+	conn.bytes_sent += bytes_sent;
+	conn.files_sent += result == SENT && error == 0;
 
-		std::string msg_size = "";
-		for (int i = 0; i < 4; i++) {
-			msg_size += (char) (nread >> (i * 8)) & 0xFF;
-		}
+	// The task's name lives in the connection's path arena, which the communication thread
+	// reuses for the next request as soon as 'pending' drops to 0, so it's copied first
+	std::string name(task.name, task.name_size);
 
-		msg = msg_size + msg;
-		call_or_exit(write_(task.fd, msg.c_str(), msg.size()), "write_ (worker thread)");
+	// The communication thread waits for this before it starts on the next request
+	if (--conn.pending == 0) {
+		status = pthread_cond_signal(&conn.cond_sent);
+		pthread_call_or_exit(status, "pthread_cond_signal (cond_sent)");
 	}
 
-	status = pthread_mutex_unlock(data.fd_to_mutex[task.fd]);
+	status = pthread_mutex_unlock(&conn.send_mutex);
 	pthread_call_or_exit(status, "pthread_mutex_unlock (worker thread: socket fd)");
 
 	status = pthread_mutex_lock(&data.log_mutex);
 	pthread_call_or_exit(status, "pthread_mutex_lock (log_mutex");
 
-	std::cerr << "[Thread " << pthread_self()
-	          << "]: Transferred file " << task.name << " successfully\n";
+	if (result == SENT && error == 0 && duplicate_of >= 0) {
+		std::cerr << "[Thread " << pthread_self()
+		          << "]: Transferred file " << name << " as a duplicate of file #"
+		          << duplicate_of << "\n";
+	} else if (result == SENT && error == 0) {
+		std::cerr << "[Thread " << pthread_self()
+		          << "]: Transferred file " << name << " successfully\n";
+	} else if (result != SOCKET_FAILED) {
+		std::cerr << "[Thread " << pthread_self()
+		          << "]: Failed to read file " << name << " (" << strerror(error)
+		          << "), the client was told to skip it\n";
+	} else {
+		std::cerr << "[Thread " << pthread_self()
+		          << "]: Skipped file " << name << ", since the connection to the client"
+		          << " is broken" << (error != 0 ? std::string(" (") + strerror(error) + ")" : "")
+		          << "\n";
+	}
 
 	status = pthread_mutex_unlock(&data.log_mutex);
 	pthread_call_or_exit(status, "pthread_mutex_unlock (log_mutex");
 
-	call_or_exit(close(file_fd), "close file (worker)");
+	BufferPool::release(buf);
+
+	if (file_fd >= 0) {
+		close(file_fd);
+	}
 }
 
 void* worker_thread(void* arg) {
+	WorkerGroup* group = (WorkerGroup *) arg;
+
 	while (true) {
-		int status = pthread_mutex_lock(&data.queue_mutex);
+		int status = pthread_mutex_lock(&group->queue_mutex);
 		pthread_call_or_exit(status, "pthread_mutex_lock (queue_mutex)");
 
-		while (data.tasks.empty()) {
-			status = pthread_cond_wait(&data.cond_nonempty, &data.queue_mutex);
+		while (group->tasks.empty() && group->nworkers <= group->pool_size) {
+			status = pthread_cond_wait(&group->cond_nonempty, &group->queue_mutex);
 			pthread_call_or_exit(status, "pthread_cond_wait (cond_nonempty, queue_mutex)");
 		}
 
-		Task task = data.tasks.front();
-		data.tasks.pop();
+		// The pool has been shrunk (on SIGHUP), so this thread isn't needed anymore
+		if (group->nworkers > group->pool_size) {
+			group->nworkers--;
+
+			status = pthread_mutex_unlock(&group->queue_mutex);
+			pthread_call_or_exit(status, "pthread_mutex_unlock (queue_mutex)");
+
+			break;
+		}
+
+		Task task = group->tasks.front();
+		group->tasks.pop();
 
 		// Broadcast to communication threads that the queue has space for new tasks
-		status = pthread_cond_broadcast(&data.cond_nonfull);
+		status = pthread_cond_broadcast(&group->cond_nonfull);
 		pthread_call_or_exit(status, "pthread_cond_broadcast (cond_nonfull)");
 
-		status = pthread_mutex_unlock(&data.queue_mutex);
+		status = pthread_mutex_unlock(&group->queue_mutex);
 		pthread_call_or_exit(status, "pthread_mutex_unlock (queue_mutex)");
 
 		status = pthread_mutex_lock(&data.log_mutex);
 		pthread_call_or_exit(status, "pthread_mutex_lock (log_mutex)");
 
 		std::cerr << "[Thread " << pthread_self()
-		          << "]: Received task: <" << task.name << ", socket=" << task.fd << ">\n";
+		          << "]: Received task: <" << task.name << ", socket=" << task.conn->fd << ">\n";
 
 		status = pthread_mutex_unlock(&data.log_mutex);
 		pthread_call_or_exit(status, "pthread_mutex_unlock (log_mutex)");
 
 		process_task(task);
+
+		task.conn->release();
 	}
 
 	return nullptr;
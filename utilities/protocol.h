@@ -0,0 +1,29 @@
+#ifndef PROTOCOL_H_
+#define PROTOCOL_H_
+
+// Special values of the protocol's integers (see the Protocol section of README.md).
+
+// Sent in place of a request's name size: starts a session (a sequence of requests on
+// the same connection) and, the second time, ends it.
+#define SESSION_MARKER (-1)
+
+// Sent before the first request (or session marker): the client asks for duplicate files
+// to be sent as references to earlier files with the same contents.
+#define DEDUP_MARKER (-2)
+
+// Sent in place of a file's size: the file couldn't be read, so no blocks follow it.
+#define FILE_ERROR (-1)
+
+// Sent in place of a file's size (dedup only): the file has the same contents as an
+// earlier one, whose index among the files sent on the connection follows.
+#define FILE_DUPLICATE (-2)
+
+// Sent in place of a block's payload size: reading the rest of the file failed, so the
+// client should discard it. No more blocks follow for that file.
+#define BLOCK_ERROR (-1)
+
+// Sent in place of a block's payload size: the file has a hole there (a range of zeros
+// that isn't stored on disk), whose size follows instead of a payload.
+#define HOLE_MARKER (-2)
+
+#endif // PROTOCOL_H_
@@ -1,8 +1,7 @@
 #ifndef READER_H_
 #define READER_H_
 
-#include <cstdio>
-#include <cstdlib>
+#include <cerrno>
 
 extern "C" {
 	#include <unistd.h>
@@ -19,20 +18,8 @@ class Reader {
   	// or eof(), if there are no more characters to read.
 
   	int next() {
-  		if (pos_ == lim_) {
-  			do {
-  				lim_ = read(fd_, buf_, BUFSIZE);
-  			} while (lim_ < 0 && errno == EINTR);
-
-  			if (lim_ < 0 && errno != EINTR) {
-				perror("read");
-				exit(EXIT_FAILURE);
-  			} else if (lim_ == 0) {
-  				eof_ = true;
-  				return -1;
-  			}
-
-  			pos_ = 0;
+  		if (pos_ == lim_ && !fill()) {
+  			return -1;
   		}
 
   		return buf_[pos_++];
@@ -41,6 +28,24 @@ class Reader {
   	bool eof() { return eof_; }
 
   private:
+  	// Refills the buffer. Returns false (and sets eof()) if there's nothing left to read,
+  	// or reading fails.
+
+  	bool fill() {
+  		do {
+  			lim_ = read(fd_, buf_, BUFSIZE);
+  		} while (lim_ < 0 && errno == EINTR);
+
+  		if (lim_ <= 0) {
+  			eof_ = true;
+  			pos_ = lim_ = 0;
+  			return false;
+  		}
+
+  		pos_ = 0;
+  		return true;
+  	}
+
   	int fd_;
   	unsigned char buf_[BUFSIZE];
 
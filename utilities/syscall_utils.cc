@@ -24,3 +24,24 @@ ssize_t write_(int fd, const char* buf, size_t nbytes) {
 
 	return nbytes;
 }
+
+ssize_t read_(int fd, char* buf, size_t nbytes) {
+	ssize_t nread;
+	size_t total = 0;
+
+	while (total < nbytes) {
+		if ((nread = read(fd, buf + total, nbytes - total)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return -1;
+		} else if (nread == 0) {
+			break;
+		}
+
+		total += nread;
+	}
+
+	return total;
+}
@@ -33,4 +33,10 @@ extern "C" {
 
 ssize_t write_(int fd, const char* buf, size_t nbytes);
 
+// Wrapper around the 'read' system call. It keeps reading until 'nbytes' have
+// been read or EOF is reached, retrying on signal interruption. In case of error,
+// it returns -1, otherwise it returns the number of bytes read (0 means EOF).
+
+ssize_t read_(int fd, char* buf, size_t nbytes);
+
 #endif // SYSCALL_UTILS_H_